@@ -0,0 +1,71 @@
+; this example program draws a green bar at the left edge of the screen
+; and scrolls the whole screen one pixel to the right every time clock1
+; pulses. the uncovered column is filled with the blue body color.
+
+; some commonly used addresses
+.def ADDR_CLOCK1 0x906
+.def ADDR_DRAW_METHOD 0x90B
+.def ADDR_DRAW_ARG1 0x90C
+.def ADDR_DRAW_ARG2 0x90D
+.def ADDR_DRAW_ARG3 0x90E
+.def ADDR_DRAW_ARG4 0x90F
+
+; method codes of the IOChip intrinsics
+.def DRAW_CLEAR 0x04
+.def DRAW_FILL 0x05
+.def DRAW_SCROLL 0x08
+.def BRUSH_SET_BODY 0x80
+
+; color codes
+.def GREEN #$1C
+.def BLUE #$03
+
+; load at reset entry
+.RST
+
+  ; clear the screen with blue
+  lda BLUE
+  sta ADDR_DRAW_ARG1
+  lda BRUSH_SET_BODY
+  sta ADDR_DRAW_METHOD
+  lda DRAW_CLEAR
+  sta ADDR_DRAW_METHOD
+
+  ; fill a green bar at the left edge
+  lda GREEN
+  sta ADDR_DRAW_ARG1
+  lda BRUSH_SET_BODY
+  sta ADDR_DRAW_METHOD
+  lda #$00              ; x coordinate
+  sta ADDR_DRAW_ARG1
+  lda #$00              ; y coordinate
+  sta ADDR_DRAW_ARG2
+  lda #$04              ; width
+  sta ADDR_DRAW_ARG3
+  lda #$24              ; height
+  sta ADDR_DRAW_ARG4
+  lda DRAW_FILL
+  sta ADDR_DRAW_METHOD
+
+  ; scrolling fills the uncovered column with blue
+  lda BLUE
+  sta ADDR_DRAW_ARG1
+  lda BRUSH_SET_BODY
+  sta ADDR_DRAW_METHOD
+
+  ; setup the clock to pulse every 100 milliseconds
+  lda #$14
+  sta ADDR_CLOCK1
+
+.LOOP
+  jmp .LOOP
+
+; scroll one pixel to the right each time the clock pulses
+.IRQ
+  lda #$01              ; dx
+  sta ADDR_DRAW_ARG1
+  lda #$00              ; dy
+  sta ADDR_DRAW_ARG2
+  lda DRAW_SCROLL
+  sta ADDR_DRAW_METHOD
+  rti
@@ -0,0 +1,78 @@
+// Measures the time from process launch to the first instruction executed by the CPU
+//
+// The guest is compute-only and never touches the display or the audio channels, so the
+// IOChip shouldn't open a window, load audio or start any threads.
+//
+// Build from the repository root:
+//   clang++ -std=c++17 -O2 -D LINUX -pthread -I include -o bin/startup_bench experiments/startup_bench.cpp
+//     src/audiosynth.cpp src/bus.cpp src/cpu.cpp src/iochip.cpp
+//     -lX11 -lsfml-window -lsfml-audio -lsfml-graphics -lsfml-system
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "bus.h"
+#include "cpu.h"
+#include "iochip.h"
+#include "rammodule.h"
+#include "rommodule.h"
+
+using namespace M6502;
+using Clock = std::chrono::steady_clock;
+
+// Initialized before main() runs, as close to the launch of the process as we can get
+static const Clock::time_point launch = Clock::now();
+
+static double elapsed_us(Clock::time_point since) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - since).count();
+}
+
+static std::string thread_count() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 8, "Threads:") == 0)
+      return line.substr(8);
+  }
+  return " unknown";
+}
+
+int main() {
+  double t_main = elapsed_us(launch);
+
+  RAMModule<kSizeRAM> ram(kAddrRAM);
+  IOChip io(kAddrIO);
+  ROMModule<kSizeROM> rom(kAddrROM);
+
+  Bus bus;
+  bus.attach_ram(&ram);
+  bus.attach_io(&io);
+  bus.attach_rom(&rom);
+
+  // INX, JMP $4920
+  uint8_t code[] = {0xe8, 0x4c, 0x20, 0x49};
+  std::copy(code, code + sizeof(code), rom.get_buffer());
+  rom.get_buffer()[kVecRES - kAddrROM] = 0x20;
+  rom.get_buffer()[kVecRES - kAddrROM + 1] = 0x49;
+
+  CPU cpu(&bus);
+  double t_machine = elapsed_us(launch);
+
+  io.start_single_threaded(false);
+  io.run_frame();
+  double t_io = elapsed_us(launch);
+
+  cpu.step();
+  double t_first = elapsed_us(launch);
+
+  std::cout << "main entered:        " << t_main << "us" << std::endl;
+  std::cout << "machine constructed: " << t_machine << "us" << std::endl;
+  std::cout << "io chip started:     " << t_io << "us" << std::endl;
+  std::cout << "first instruction:   " << t_first << "us" << std::endl;
+  std::cout << "threads:            " << thread_count() << std::endl;
+
+  io.stop();
+  return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <SFML/Audio.hpp>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "iochip.h"
+
+#pragma once
+
+namespace M6502 {
+
+// Write to an audio channel register, applied once the synthesizer reaches the given sample
+struct AudioEvent {
+  uint64_t sample;
+  uint8_t channel;
+  uint8_t value;
+};
+
+// State of a single oscillator
+//
+// The phase is measured in periods and kept in the range [0, 1)
+struct AudioOscillator {
+  float phase = 0.0f;
+  float increment = 0.0f;
+  float amplitude = 0.0f;
+  uint8_t wave_function = kIOAudioChannelWaveSine;
+};
+
+// Synthesizer mixing the audio channels of the IOChip
+//
+// Register writes are queued with the sample they should take effect at and are applied
+// at exactly that sample while rendering. Rendering is split into spans between two writes,
+// in which every oscillator is a plain loop over a block of samples without any branches,
+// so the compiler can vectorize it.
+//
+// Writes may come from a different thread than the one rendering the samples.
+class AudioSynth {
+public:
+  // Queue a write to an audio channel register
+  //
+  // Writes are expected in chronological order. Writes for samples which have already been
+  // rendered are applied at the start of the next block.
+  void write(uint64_t sample, uint8_t channel, uint8_t value);
+
+  // Render the next samples into buffer
+  void render(sf::Int16* buffer, size_t count);
+
+  // The amount of samples rendered so far
+  inline uint64_t position() {
+    return this->rendered;
+  }
+
+private:
+  void apply(const AudioEvent& event);
+  void mix_span(float* mix, size_t count);
+
+  AudioOscillator oscillators[kIOAudioChannelCount];
+  std::deque<AudioEvent> events;
+  std::mutex events_mutex;
+  std::atomic<uint64_t> rendered{0};
+};
+
+// Streams the output of a synthesizer to the audio device
+//
+// Blocks are kept small, so register writes become audible a few milliseconds after they happen.
+class AudioStream : public sf::SoundStream {
+public:
+  AudioStream(AudioSynth* synth);
+
+private:
+  bool onGetData(Chunk& data);
+  void onSeek(sf::Time);
+
+  AudioSynth* synth;
+  sf::Int16 block[kIOAudioBlockSize];
+};
+
+// Writes mono 16-bit samples to a WAV file, returns false if the file couldn't be written
+bool write_wav(const std::string& path, const std::vector<sf::Int16>& samples, uint32_t sample_rate);
+
+}  // namespace M6502
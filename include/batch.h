@@ -0,0 +1,125 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "inputlog.h"
+#include "machine.h"
+#include "threadpool.h"
+
+#pragma once
+
+namespace M6502 {
+
+// Memory range read back from a machine once its job ended
+struct BatchOutput {
+  uint16_t address;
+  uint16_t size;
+};
+
+// A single machine run by the batch runner
+struct BatchJob {
+  // Flashed into the ROM, starting at kAddrROM. Images of kSizeROM bytes contain the interrupt vectors.
+  std::vector<uint8_t> image;
+
+  // Inputs delivered once the CPU reaches their cycle (see Bus::start_replay). Events go to the IO
+  // chip directly, even if the guest has disabled the keyboard or mouse.
+  std::vector<InputRecord> inputs;
+
+  // The job ends once the CPU executed this many instructions or halted
+  uint64_t instruction_budget = 0;
+
+  std::vector<BatchOutput> outputs;
+};
+
+struct BatchResult {
+  uint64_t instructions = 0;
+  uint64_t cycles = 0;
+  bool illegal_opcode = false;
+
+  // Contents of the output ranges, in the order of BatchJob::outputs
+  std::vector<std::vector<uint8_t>> outputs;
+};
+
+// Runs many independent machines on a work-stealing thread pool
+//
+// Each job gets its own machine, created when the job first runs and destroyed once it ended. A job
+// runs for slice_frames frames at a time, with IOChip::run_frame between frames just like a headless
+// machine, and then resubmits itself to the pool. Workers continue with their own job first, so only
+// about one machine per worker is alive at a time, while idle workers steal jobs which haven't
+// started yet.
+class BatchRunner {
+public:
+  BatchRunner(size_t thread_count = std::thread::hardware_concurrency());
+
+  // Amount of frames a job runs for before it goes back to the pool
+  size_t slice_frames = 4;
+
+  // Runs all jobs and blocks until they ended. The results are in the order of the jobs.
+  std::vector<BatchResult> run(const std::vector<BatchJob>& jobs);
+
+  // Statistics of the last run()
+  inline uint64_t get_instructions() {
+    return this->instructions;
+  }
+  inline double get_seconds() {
+    return this->seconds;
+  }
+  inline double get_mips() {
+    return this->seconds > 0 ? this->instructions / this->seconds / 1000000.0 : 0;
+  }
+
+  inline size_t get_thread_count() {
+    return this->pool.size();
+  }
+
+private:
+  struct JobState {
+    const BatchJob* job;
+    BatchResult* result;
+    std::unique_ptr<Machine> machine;
+    InputLog inputs;
+
+    // Cycle at which the current frame ends
+    uint64_t frame_end = 0;
+  };
+
+  void run_slice(JobState* state);
+  void start_job(JobState* state);
+  void finish_job(JobState* state);
+
+  ThreadPool pool;
+  std::atomic<uint64_t> instructions = 0;
+  double seconds = 0;
+};
+
+}  // namespace M6502
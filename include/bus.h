@@ -25,10 +25,14 @@
  * SOFTWARE.
  */
 
+#include <array>
 #include <atomic>
 #include <cstdint>
+#include <functional>
+#include <vector>
 
 #include "busdevice.h"
+#include "inputlog.h"
 
 #pragma once
 
@@ -44,6 +48,14 @@ static constexpr size_t kSizeRAM = 0x4000;
 static constexpr size_t kSizeIO = 0x920;
 static constexpr size_t kSizeROM = 0xB6E0;
 
+// The optional mailbox device replaces the end of RAM (see MailboxDevice)
+static constexpr uint16_t kAddrMailbox = 0x3FE0;
+static constexpr size_t kSizeMailbox = 0x20;
+
+// Maximum amount of cores attached to a bus, and the core index which addresses all of them
+static constexpr size_t kMaxCores = 8;
+static constexpr uint8_t kCoreAll = 0xFF;
+
 // Forward declaration
 class CPU;
 
@@ -56,6 +68,7 @@ public:
   // Read access
   uint8_t read_byte(uint16_t address);
   uint16_t read_word(uint16_t address);
+  void read_block(uint16_t address, uint8_t* buffer, size_t size);
 
   // Write access
   void write_byte(uint16_t address, uint8_t value);
@@ -65,21 +78,195 @@ public:
   BusDevice* resolve_address_to_device(uint16_t address);
 
   // Attach devices to the different parts of the bus
-  void attach_cpu(CPU* cpu);
   void attach_ram(BusDevice* dev);
   void attach_io(BusDevice* dev);
   void attach_rom(BusDevice* dev);
+  void attach_mailbox(BusDevice* dev);
+
+  // Multiple cores
+  //
+  // Every CPU constructed with this bus is attached as the next core, up to kMaxCores. Each core is
+  // meant to run on its own host thread, sharing RAM, IO and ROM with the other cores. Cores can tell
+  // each other apart by reading the core id register of the mailbox device, which also provides the
+  // semaphores and mailboxes for signalling between cores. They have to set up their own stacks.
+  //
+  // Core 0 is the primary core: the IO chip raises its interrupts there, and in virtual time mode it
+  // drives the devices and input replay with its cycle count. The other cores never advance devices.
+  // Runs with multiple cores aren't deterministic, since the cores aren't synchronized.
+  //
+  // Memory ordering: accesses of different cores to RAM are unordered with respect to each other.
+  // Unsynchronized accesses of two cores to the same byte, where at least one of them writes, are not
+  // supported. Shared data has to be guarded by a semaphore or handed over through a mailbox: taking
+  // a semaphore or reading a message synchronizes with the core which gave the semaphore or sent the
+  // message, after which all RAM writes that core made before are visible.
+  //
+  // Returns false if kMaxCores cores are attached already. Attaching a CPU which is already attached
+  // does nothing.
+  bool attach_cpu(CPU* cpu);
+  inline size_t get_core_count() {
+    return this->cpus.size();
+  }
+
+  // Index of the core running on the calling thread
+  //
+  // Set by the CPU whenever it starts running on a thread. Threads which don't run a core read 0.
+  static thread_local uint8_t current_core;
 
   // Interrupts
-  void int_irq();
-  void int_nmi();
-  void int_res();
+  //
+  // Delivered to a single core, or to all of them if kCoreAll is given
+  void int_irq(uint8_t core = 0);
+  void int_nmi(uint8_t core = 0);
+  void int_res(uint8_t core = 0);
+
+  // Address of the handler a core jumps to when servicing an IRQ
+  //
+  // Asks the attached devices for a vectored handler first and falls back to the IRQ vector. The IO
+  // chip is only asked on the primary core, since that's where it raises its interrupts.
+  uint16_t irq_vector(uint8_t core = 0);
+
+  // Snapshots
+  //
+  // Captures the state of the CPU and all attached devices in a versioned binary format (see snapshot.h).
+  // A snapshot can only be restored into a machine with the same devices attached. The CPU must not be
+  // running while a snapshot is taken or restored.
+  //
+  // restore() returns false if the snapshot is invalid or has a different format version. Invalid
+  // snapshots are detected while restoring, so the machine might be partially restored in that case.
+  std::vector<uint8_t> snapshot();
+  bool restore(const std::vector<uint8_t>& data);
+
+  // Incremental snapshots
+  //
+  // Captures the pages modified since the previous incremental snapshot with their previous contents,
+  // along with the rest of the machine state (see BusDevice::snapshot_delta). Used by RewindBuffer.
+  //
+  // restore_delta() reverts the recorded pages if undo_pages is set and restores everything else if
+  // restore_state is set.
+  std::vector<uint8_t> snapshot_delta();
+  bool restore_delta(const std::vector<uint8_t>& data, bool undo_pages, bool restore_state);
+
+  // Golden state
+  //
+  // Saves the state of the machine, so it can be returned to repeatedly, e.g. between fuzzing runs.
+  // RAM and the IO chip keep golden copies and only put back the pages modified since, so resetting
+  // costs time proportional to the memory the guest touched (see BusDevice::save_golden). ROM is left
+  // as is.
+  //
+  // reset_to_golden() returns false if no golden state was saved.
+  void save_golden();
+  bool reset_to_golden();
+
+  // Input recording
+  //
+  // Records all inputs which reach the machine from the outside into a log, along with the CPU cycle
+  // they arrived at: the events devices receive from the host and NMI and reset interrupts. IRQs aren't
+  // recorded, as devices raise them in response to their inputs and timers.
+  //
+  // Replaying restores the snapshot the log starts with and delivers the inputs again once the CPU
+  // reaches their cycle. Inputs from the outside are dropped while a log is replayed. The CPU only
+  // notices inputs in between instructions, so a replay reproduces the recorded run exactly as long
+  // as the inputs arrived in between calls to CPU::run_for or CPU::run_until, e.g. from
+  // IOChip::run_frame. Inputs are also kept in order with the frames ending at their cycle, so they
+  // reach the guest on the same side of the VBLANK event as during the recording.
+  //
+  // Recording and replaying require virtual time and return false without it. start_replay() also
+  // returns false if the snapshot of the log can't be restored. Logs without a snapshot are replayed
+  // from the current state of the machine.
+  bool start_recording(InputLog* log);
+  void stop_recording();
+  bool start_replay(InputLog* log);
+  void stop_replay();
+  inline bool is_replaying() {
+    return this->replay_log != nullptr;
+  }
+
+  // Called by IOChip::run_frame once the inputs of a frame arrived, before the VBLANK event is raised
+  //
+  // Delivers the replayed inputs which arrived before the end of the frame.
+  void end_frame();
+
+  // Called for every input from the outside, records it if a log is being recorded. Returns false if
+  // the input has to be dropped, because a log is being replayed. Interrupts pass the core they are
+  // delivered to as their type.
+  bool accept_input(uint8_t kind, uint8_t type = 0x00, uint8_t payload1 = 0x00, uint8_t payload2 = 0x00);
+
+  // Virtual time
+  //
+  // In virtual time mode, devices schedule their events in CPU clock cycles instead of
+  // wall clock time. The CPU advances the devices from its own run loop once it reaches
+  // the next scheduled cycle, which makes peripheral timing deterministic and independent
+  // of the host. Virtual time has to be enabled before any device schedules an event.
+  void enable_virtual_time();
+  inline bool is_virtual_time() {
+    return this->virtual_time;
+  }
+
+  // The amount of cycles the primary core has executed so far
+  uint64_t current_cycle();
+
+  // Called by devices when they schedule an event at a given cycle
+  inline void schedule_event(uint64_t cycle) {
+    if (cycle < this->next_device_event)
+      this->next_device_event = cycle;
+    if (cycle < this->next_event)
+      this->next_event = cycle;
+  }
+
+  // Process all device events and replayed inputs due at or before the given cycle
+  void advance(uint64_t cycle);
+
+  // Process device events only, used by the CPU while it waits for an interrupt
+  //
+  // Replayed inputs have to wait until the CPU stops waiting at the end of its slice, since that's
+  // where they arrived while recording.
+  void advance_devices(uint64_t cycle);
+
+  // Cycle of the earliest scheduled device event or replayed input
+  uint64_t next_event = kCycleNever;
+  uint64_t next_device_event = kCycleNever;
 
 private:
   // Attached devices
-  CPU* cpu;
+  std::vector<CPU*> cpus;
   BusDevice* RAM = nullptr;
   BusDevice* IO = nullptr;
   BusDevice* ROM = nullptr;
+  BusDevice* mailbox = nullptr;
+
+  // Sets an interrupt line of a core and wakes it up if it's waiting for an interrupt
+  static void raise(CPU* cpu, std::atomic<bool> CPU::*line);
+
+  bool virtual_time = false;
+
+  // Input recording and replay
+  InputLog* record_log = nullptr;
+  InputLog* replay_log = nullptr;
+  size_t replay_position = 0;
+  uint32_t record_frame = 0;
+  uint32_t replay_frame = 0;
+  uint64_t next_input = kCycleNever;
+  bool delivering_input = false;
+
+  // Delivers all replayed inputs due at the given cycle and schedules the next one
+  void replay_inputs(uint64_t cycle);
+  bool input_due(const InputRecord& record, uint64_t cycle);
+  void schedule_input();
+
+  // Saved by save_golden()
+  std::vector<uint8_t> golden;
+
+  // Snapshot sections
+  //
+  // Every snapshot holds a section with the registers of all cores, followed by a section for each
+  // attached device in the order of device_sections(). Adding a device to the table adds it to all
+  // kinds of snapshots. read_sections() returns false if a section is missing or, unless partial is
+  // set, wasn't consumed completely. Partially read sections are skipped instead.
+  std::array<std::pair<uint8_t, BusDevice*>, 4> device_sections();
+  void write_sections(SnapshotWriter& writer, const std::function<void(BusDevice*)>& write_device);
+  bool read_sections(SnapshotReader& reader,
+                     bool restore_cpus,
+                     bool partial,
+                     const std::function<void(BusDevice*)>& read_device);
 };
 }  // namespace M6502
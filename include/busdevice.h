@@ -36,7 +36,12 @@ namespace M6502 {
 using BusRead = std::function<uint8_t(uint16_t)>;
 using BusWrite = std::function<void(uint16_t, uint8_t)>;
 
+// Cycle value used by devices which have no event scheduled
+static constexpr uint64_t kCycleNever = UINT64_MAX;
+
 class Bus;  // forward declaration
+class SnapshotWriter;
+class SnapshotReader;
 
 // Abstraction of a device attached to the bus
 class BusDevice {
@@ -48,6 +53,75 @@ public:
   virtual uint8_t read(uint16_t address) = 0;
   virtual void write(uint16_t address, uint8_t value) = 0;
 
+  // Copy a block of memory out of the device
+  //
+  // Devices backed by a plain buffer should override this with a memcpy
+  virtual void read_block(uint16_t address, uint8_t* buffer, size_t size) {
+    for (size_t i = 0; i < size; i++)
+      buffer[i] = this->read(address + i);
+  }
+
+  // Virtual time
+  //
+  // Called by the bus when the CPU reached a cycle a device scheduled an event for.
+  // Devices process all events due at or before the given cycle and return the cycle
+  // of their next event, or kCycleNever if there is none.
+  virtual uint64_t advance(uint64_t) {
+    return kCycleNever;
+  }
+
+  // Interrupt vectoring
+  //
+  // Called by the bus when the CPU services an IRQ. Devices which raised the interrupt can return
+  // the address of a dedicated handler, or 0 to leave it to the regular IRQ vector.
+  virtual uint16_t interrupt_vector() {
+    return 0;
+  }
+
+  // Snapshots
+  //
+  // Devices write their complete state into the snapshot and read it back in the same order.
+  // Devices without any state don't need to override these.
+  virtual void snapshot(SnapshotWriter&) {
+  }
+  virtual void restore(SnapshotReader&) {
+  }
+
+  // Incremental snapshots
+  //
+  // Used by the rewind buffer. Devices with dirty tracking write their memory as a list of the pages
+  // modified since the previous incremental snapshot, containing the contents they had back then,
+  // followed by the rest of their state. Restoring with undo_pages set writes these pages back, which
+  // reverts the modifications. Restoring with restore_state set restores the rest of the state.
+  //
+  // Devices without dirty tracking write their full snapshot instead.
+  virtual void snapshot_delta(SnapshotWriter& writer) {
+    this->snapshot(writer);
+  }
+  virtual void restore_delta(SnapshotReader& reader, bool, bool restore_state) {
+    if (restore_state)
+      this->restore(reader);
+  }
+
+  // Golden state
+  //
+  // Used by Bus::save_golden and Bus::reset_to_golden. Devices with paged memory keep references
+  // to their pages instead of writing them, and only put back the pages modified since then.
+  // Other devices write their full snapshot.
+  virtual void save_golden(SnapshotWriter& writer) {
+    this->snapshot(writer);
+  }
+  virtual void restore_golden(SnapshotReader& reader) {
+    this->restore(reader);
+  }
+
+  // Input replay
+  //
+  // Called by the bus to deliver an event the device recorded via Bus::accept_input before.
+  // Devices which don't receive any input from the outside don't need to override this.
+  virtual void inject_event(uint8_t, uint8_t, uint8_t) {
+  }
+
   // The address at which this device was mapped into memory
   uint16_t mapped_address;
   Bus* bus;
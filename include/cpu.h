@@ -68,6 +68,38 @@ static constexpr uint8_t kMaskCarry = 0x01;
 static constexpr uint16_t kStackBase = 0x0100;
 static constexpr uint16_t kStackReset = 0xFF;
 
+// Base amount of clock cycles each opcode takes
+//
+// Additional cycles for taken branches and page boundary crossings are not modelled.
+// Illegal opcodes halt the CPU and are listed with 2 cycles.
+static constexpr uint8_t kOpcodeCycles[256] = {
+    7, 6, 3, 2, 2, 3, 5, 2, 3, 2, 2, 2, 2, 4, 6, 2,  // 0x00
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0x10
+    6, 6, 2, 2, 3, 3, 5, 2, 4, 2, 2, 2, 4, 4, 6, 2,  // 0x20
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0x30
+    6, 6, 2, 2, 2, 3, 5, 2, 3, 2, 2, 2, 3, 4, 6, 2,  // 0x40
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0x50
+    6, 6, 2, 2, 2, 3, 5, 2, 4, 2, 2, 2, 5, 4, 6, 2,  // 0x60
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0x70
+    2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2,  // 0x80
+    2, 6, 2, 2, 4, 4, 4, 2, 2, 5, 2, 2, 2, 5, 2, 2,  // 0x90
+    2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2,  // 0xA0
+    2, 5, 2, 2, 4, 4, 4, 2, 2, 4, 2, 2, 4, 4, 4, 2,  // 0xB0
+    2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2,  // 0xC0
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0xD0
+    2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2,  // 0xE0
+    2, 5, 2, 2, 2, 4, 6, 2, 2, 4, 2, 2, 2, 4, 7, 2,  // 0xF0
+};
+
+// Amount of clock cycles it takes to enter an interrupt handler
+static constexpr uint8_t kInterruptCycles = 7;
+
+// Amount of counters in an edge coverage map (see CPU::coverage)
+static constexpr size_t kCoverageMapSize = 0x4000;
+
+// Clock rate of the CPU in Hz, used to convert between clock cycles and time
+static constexpr uint64_t kClockRate = 1000000;
+
 // Virtual CPU for the MOS 6502
 class CPU {
 public:
@@ -79,9 +111,30 @@ public:
   // Execute a single instruction
   void cycle();
 
+  // Execute instructions for a given amount of clock cycles
+  //
+  // Meant for virtual time mode. Instructions are executed back to back until
+  // the next scheduled device event is due, at which point the devices catch up
+  // to the current cycle. Returns the amount of cycles that were executed, which
+  // can be less than requested if the CPU halted.
+  uint64_t run_for(uint64_t cycles);
+
+  // Execute instructions until the program counter reaches a given address
+  //
+  // Works like run_for(), but stops as soon as an instruction leaves the program counter at
+  // address. Returns false if the address wasn't reached within the given amount of cycles.
+  bool run_until(uint16_t address, uint64_t cycles);
+
+  // Execute a single instruction without yielding or advancing devices
+  void step();
+
   // Dump debugging information to a stream
   void dump_state(std::ostream& out);
 
+  // Write the registers and the interrupt state into a snapshot and read them back
+  void snapshot(SnapshotWriter& writer);
+  void restore(SnapshotReader& reader);
+
   // Reset interrupt
   //
   // TODO: Make this thread safe
@@ -101,8 +154,9 @@ public:
 
   // Dipsatch table indexed by instruction opcode
   //
-  // This table is populated at CPU construction
-  Instruction dispatch_table[256];
+  // This table is shared by all CPUs and populated when the first one is constructed
+  static Instruction dispatch_table[256];
+  static void fill_dispatch_table();
 
   // Executes a single instruction
   void exec_instruction(Instruction instruction);
@@ -110,6 +164,14 @@ public:
   // Read and write single bytes from the bus
   Bus* bus;
 
+  // Index of this core on the bus (see Bus::attach_cpu)
+  uint8_t core = 0;
+
+  // Cycle of the next event the run loops stop for to advance the bus
+  //
+  // Points at Bus::next_event on the primary core. The other cores never advance the bus.
+  const uint64_t* next_event = &kCycleNever;
+
   // Accumulator register
   //
   // This is the only register that is able to perform math operations
@@ -155,6 +217,15 @@ public:
     uint8_t STATUS;
   };
 
+  // Amount of clock cycles executed since the CPU was created
+  uint64_t cycles;
+
+  // Amount of instructions executed since the CPU was created, only used for statistics
+  uint64_t instructions;
+
+  // Cycle at which the current run_for() slice ends, kCycleNever outside of run_for()
+  uint64_t run_end = kCycleNever;
+
   // Stores wether the last instruction was an illegal one
   // The CPU should just halt when it encounters an illegal
   // instruction
@@ -176,6 +247,19 @@ public:
   std::condition_variable cv_int;
   std::mutex mutex_int;
 
+  // Edge coverage map with kCoverageMapSize counters
+  //
+  // If set, every branch, jump, call, return and interrupt increments the counter of the edge
+  // between the current instruction and the address execution continues at. Counters wrap around.
+  uint8_t* coverage = nullptr;
+  inline void record_edge(uint16_t from, uint16_t to) {
+    if (this->coverage != nullptr)
+      this->coverage[((from >> 1) ^ to) & (kCoverageMapSize - 1)]++;
+  }
+
+  // Taken and untaken branches are different edges
+  void branch(uint16_t src, bool condition);
+
   // Methods which handle different interrupts
   void handle_irq();
   void handle_brk();
@@ -0,0 +1,126 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "cpu.h"
+
+#pragma once
+
+namespace M6502 {
+
+// Forward declarations
+class Machine;
+
+// Outcome of a single fuzzing run
+enum {
+  kFuzzOk = 0,
+  kFuzzIllegalOpcode = 1,
+  kFuzzRunaway = 2,
+};
+
+// Input which made the guest execute an illegal opcode or run away
+struct FuzzFinding {
+  int outcome;
+  uint16_t address;
+  std::vector<uint8_t> input;
+};
+
+// In-process, coverage guided fuzzer for guest programs
+//
+// The machine should be waiting for input when the fuzzer is created, its state is saved as the
+// golden state then. Every run resets the machine to the golden state, injects the
+// input and executes the guest with edge coverage enabled. Inputs reaching new edges, or known edges
+// a different number of times, are added to the corpus and mutated further.
+//
+// An input is injected in two parts:
+//   - The first ram_size bytes are copied into RAM at ram_address.
+//   - The remaining bytes are raised as keyboard events, two bytes each. The first byte is the
+//     keycode, the second one holds the modifiers and is a keyup event if its top bit is set.
+//
+// After the RAM is written and after every event, the guest runs until the program counter gets back
+// to exit_address, e.g. the main loop which waits for interrupts. If it doesn't get there within
+// cycle_budget cycles, the run is reported as runaway execution.
+class Fuzzer {
+public:
+  Fuzzer(Machine* machine, uint16_t exit_address);
+
+  // Where inputs go and how long the guest may run for each part of it
+  uint16_t ram_address = 0;
+  size_t ram_size = 0;
+  uint64_t cycle_budget = kClockRate / 60;
+  size_t max_input_size = 64;
+
+  // Inputs the fuzzer starts mutating from. An empty input is used if there are none.
+  void add_seed(const std::vector<uint8_t>& input);
+
+  // Runs a single input and returns its outcome. The coverage map is left as the run produced it.
+  int run(const std::vector<uint8_t>& input);
+
+  // Mutates and runs the given amount of inputs
+  void fuzz(size_t iterations);
+
+  inline const std::vector<std::vector<uint8_t>>& get_corpus() {
+    return this->corpus;
+  }
+  inline const std::vector<FuzzFinding>& get_findings() {
+    return this->findings;
+  }
+  inline size_t get_executions() {
+    return this->executions;
+  }
+
+  // Amount of distinct edges reached so far
+  inline size_t get_edges() {
+    return this->edges;
+  }
+
+private:
+  // Merges the coverage of the last run, returns true if it contained anything new
+  bool update_coverage();
+
+  void record_finding(int outcome, const std::vector<uint8_t>& input);
+  std::vector<uint8_t> mutate(const std::vector<uint8_t>& input);
+
+  Machine* machine;
+  uint16_t exit_address;
+
+  // Coverage of the current run and the hit count buckets seen for every edge
+  uint8_t coverage[kCoverageMapSize];
+  uint8_t seen[kCoverageMapSize];
+  size_t edges = 0;
+
+  std::vector<std::vector<uint8_t>> corpus;
+  std::vector<FuzzFinding> findings;
+  size_t executions = 0;
+  std::mt19937 rng;
+};
+
+}  // namespace M6502
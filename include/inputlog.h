@@ -0,0 +1,89 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#pragma once
+
+namespace M6502 {
+
+// Kinds of recorded inputs
+enum {
+  kInputEvent = 0,
+  kInputNMI = 1,
+  kInputReset = 2,
+};
+
+// A single input, raised at the given CPU cycle
+//
+// Events carry the type and payload bytes the IO chip raised them with. Interrupts carry the core
+// they were delivered to as their type.
+//
+// The frame is the amount of frames which ended since the recording started (see Bus::end_frame).
+// It orders inputs which arrived at the cycle a frame ended at with respect to the VBLANK event.
+struct InputRecord {
+  uint64_t cycle;
+  uint8_t kind;
+  uint8_t type;
+  uint8_t payload1;
+  uint8_t payload2;
+  uint32_t frame = 0;
+};
+
+// Log of all inputs which reached the machine from the outside (see Bus::start_recording)
+//
+// Starts with a snapshot of the machine taken when the recording started, so it can be replayed
+// into any machine with the same devices attached.
+class InputLog {
+public:
+  // Appends a record, can be called from any thread
+  void record(uint64_t cycle,
+              uint32_t frame,
+              uint8_t kind,
+              uint8_t type = 0x00,
+              uint8_t payload1 = 0x00,
+              uint8_t payload2 = 0x00);
+
+  // Serialized as a snapshot header followed by a single section (see snapshot.h). deserialize()
+  // returns false if the data is invalid.
+  std::vector<uint8_t> serialize();
+  bool deserialize(const std::vector<uint8_t>& data);
+
+  std::vector<uint8_t> snapshot;
+  std::vector<InputRecord> records;
+
+  // Cycle at which the recording was stopped
+  uint64_t end_cycle = 0;
+
+private:
+  std::mutex mutex;
+};
+
+}  // namespace M6502
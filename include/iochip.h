@@ -29,8 +29,10 @@
 #include <SFML/Graphics.hpp>
 #include <SFML/Window.hpp>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
+#include <memory>
 #include <queue>
 #include <shared_mutex>
 #include <string>
@@ -38,11 +40,16 @@
 #include <vector>
 
 #include "busdevice.h"
+#include "snapshot.h"
 
 #pragma once
 
 namespace M6502 {
 
+// Forward declarations
+class AudioSynth;
+class AudioStream;
+
 // IOChip
 //
 // The virtual display shows a 64x36 window, where each pixel is directly addressable
@@ -54,6 +61,9 @@ namespace M6502 {
 //
 //   RGB-Pixel: rrrgggbb
 //
+//   If the palette flag in the control byte is set, each pixel is instead an index into a palette of 256 24-bit
+//   colors, which can be programmed via the palette control ports (see kIOPaletteIndex).
+//
 //   The background and foreground color configuration bytes have no effect in this mode and are ignored.
 //
 // Text mode:
@@ -61,7 +71,7 @@ namespace M6502 {
 //   plain old ASCII. Character codes above 0x7f (bytes where bit 7 is set) are interpreted as 0x00 - 0x7f but are
 //   rendered with the background and foreground colors swapped. Background and foreground colors of the display
 //   can be configured at their respective control ports. The color encodings of these values are defined via the
-//   respective flag in the control byte of the IO chip.
+//   palette flag in the control byte of the IO chip.
 //
 //   Character: 0 0000000
 //              ^ ^
@@ -69,9 +79,17 @@ namespace M6502 {
 //              | +- ANSCII Character code
 //              +--- Swap background and foreground color
 //
+//   Every character is an 8x8 tile. The tiles are taken from the built-in character set, unless a custom tile set
+//   has been selected via the tile set control port (see kIOTileSet).
+//
 // Keyboard & Mouse access:
 //   The IOChip listens for keyboard and mouse events. These events are passed to the CPU via the interrupt mechanism.
 //   Interrupts for either keyboard or mouse events can be disabled via their respective flags in the control byte.
+//
+//   Mouse coordinates are reported in display pixels. A mouse move event is only raised once the mouse enters
+//   another pixel, and if the event queue is enabled, consecutive mouse moves which haven't been presented yet
+//   collapse into a single event carrying the latest coordinates. Mouse button events are raised for the left
+//   mouse button only.
 static std::string kIOVideoTitle = "6502 Microcontroller";
 static constexpr size_t kIOVideoWidth = 64;
 static constexpr size_t kIOVideoHeight = 36;
@@ -80,6 +98,7 @@ static constexpr size_t kIOVideoScaleHeight = 17;
 static constexpr size_t kIOVideoModeWidth = kIOVideoWidth * kIOVideoScaleWidth;
 static constexpr size_t kIOVideoModeHeight = kIOVideoHeight * kIOVideoScaleHeight;
 static constexpr size_t kIOVRAMSize = kIOVideoWidth * kIOVideoHeight;
+static constexpr size_t kIOVRAMPageCount = (kIOVRAMSize + kSnapshotPageSize - 1) / kSnapshotPageSize;
 static constexpr size_t kIOVideoRedMask = 0xE0;
 static constexpr size_t kIOVideoGreenMask = 0x1C;
 static constexpr size_t kIOVideoBlueMask = 0x03;
@@ -143,10 +162,13 @@ static constexpr uint16_t kIOClock2 = 0x907;
 //               |  +---- Wave function (sine, square, saw, triangle)
 //               +------- Volume (0%, 25%, 50%, 100%)
 //
-// Setting the volume to 0 will stop playing the audio, so no resources are wasted playing a mute sound.
+// The channels are mixed by a synthesizer which streams small blocks of samples to the audio device. Writes to the
+// channel registers take effect at the sample corresponding to the time of the write. Channels with a volume of 0
+// are skipped by the synthesizer, so no resources are wasted playing a mute sound.
 static constexpr uint16_t kIOAudioChannel1 = 0x908;
 static constexpr uint16_t kIOAudioChannel2 = 0x909;
 static constexpr uint16_t kIOAudioChannel3 = 0x90A;
+static constexpr size_t kIOAudioChannelCount = 3;
 
 // Masks for the audio channel
 static constexpr uint8_t kIOAudioChannelVolume = 0xC0;
@@ -163,12 +185,13 @@ enum {
   kIOAudioChannelWaveTriangle = 3,
 };
 
-// Some constants related to how audio data is stored inside the chip
-static constexpr uint32_t kIOAudioSamples = 44100;
+// Some constants related to how audio data is generated inside the chip
+//
+// A block of 512 samples holds about 12ms of audio
 static constexpr uint32_t kIOAudioSampleRate = 44100;
 static constexpr uint32_t kIOAudioAmplitude = 30000;
-static constexpr double kIOAudioTwoPi = 6.28318;
-static constexpr double kIOAudioSampleIncrement = 440.0 / 44100;
+static constexpr float kIOAudioBaseFrequency = 440.0f;
+static constexpr size_t kIOAudioBlockSize = 512;
 
 // VRAM Access
 //
@@ -186,9 +209,21 @@ static constexpr double kIOAudioSampleIncrement = 440.0 / 44100;
 //  io_draw_dot(x, y) - Uses the body color
 //  io_draw_line(x1, y2, x2, y2)
 //
+// Block operations
+//  io_draw_clear() - Fills the whole screen with the body color
+//  io_draw_fill(x, y, w, h) - Fills a region with the body color, no outline is drawn
+//  io_draw_copy(x, y, w, h) - Copies the region at the brush origin to (x, y), regions may overlap
+//  io_draw_blit(x, y, w, h) - Copies w * h bytes from the brush source address to (x, y)
+//  io_draw_scroll(dx, dy) - Scrolls the screen, dx and dy are signed. Uncovered pixels use the body color
+//
 // Color
 //  io_brush_set_body(v)
 //  io_brush_set_outline(v)
+//
+// Block operation configuration
+//  io_brush_set_origin(x, y) - Source position for io_draw_copy
+//  io_brush_set_source(lo, hi, stride) - Source address and row stride for io_draw_blit
+//  io_brush_set_key(v, e) - Pixels of color v are skipped by io_draw_blit if e is not 0
 static constexpr uint16_t kIODrawMethod = 0x90B;
 static constexpr uint16_t kIODrawArg1 = 0x90C;
 static constexpr uint16_t kIODrawArg2 = 0x90D;
@@ -200,8 +235,16 @@ static constexpr uint8_t kIODrawRectangle = 0x00;
 static constexpr uint8_t kIODrawSquare = 0x01;
 static constexpr uint8_t kIODrawDot = 0x02;
 static constexpr uint8_t kIODrawLine = 0x03;
+static constexpr uint8_t kIODrawClear = 0x04;
+static constexpr uint8_t kIODrawFill = 0x05;
+static constexpr uint8_t kIODrawCopy = 0x06;
+static constexpr uint8_t kIODrawBlit = 0x07;
+static constexpr uint8_t kIODrawScroll = 0x08;
 static constexpr uint8_t kIOBrushSetBody = 0x80;
 static constexpr uint8_t kIOBrushSetOutline = 0x81;
+static constexpr uint8_t kIOBrushSetOrigin = 0x82;
+static constexpr uint8_t kIOBrushSetSource = 0x83;
+static constexpr uint8_t kIOBrushSetKey = 0x84;
 
 // Writing to this memory locations will start a timer, which fires an IRQ interrupt
 // after the specified amount of time. The value inside the two bytes is read as a 16-bit
@@ -209,7 +252,8 @@ static constexpr uint8_t kIOBrushSetOutline = 0x81;
 // should pass. Writing to the Lo byte will trigger the timer. Writing to the Hi byte
 // only has no effect. The memory won't be altered at any phase in the timer.
 //
-// A timer cannot be cancelled once activated.
+// A timer cannot be cancelled once activated. Writing to the Lo byte of a running timer
+// restarts it with the new value.
 //
 // timer: 00000000
 //        ^
@@ -231,16 +275,145 @@ static constexpr uint16_t kIOTimer2Hi = 0x913;
 static constexpr uint16_t kIOCounter1 = 0x914;
 static constexpr uint16_t kIOCounter2 = 0x915;
 
+// Hardware sprites
+//
+// The IOChip composites up to 32 sprites over the VRAM contents each time a frame is presented. Sprites never
+// modify VRAM, so moving one only requires updating its position.
+//
+// The sprite table is stored in RAM. The value in this memory location selects the page (the high byte of the
+// address) the table starts at. Writing 0 disables the sprite layer.
+//
+// Each sprite table entry is 8 bytes in size:
+//
+//   +0 x coordinate
+//   +1 y coordinate
+//   +2 width
+//   +3 height
+//   +4 pixel data address lo
+//   +5 pixel data address hi
+//   +6 color key, pixels of this color are transparent
+//   +7 flags
+//
+// The pixel data is stored row by row, with no padding between rows.
+//
+// Flags: 0 0000000
+//        ^ ^
+//        | |
+//        | +- Reserved for future expansion
+//        +--- Sprite visible
+static constexpr uint16_t kIOSpriteTable = 0x916;
+static constexpr size_t kIOSpriteCount = 32;
+static constexpr size_t kIOSpriteEntrySize = 8;
+static constexpr uint8_t kIOSpriteVisible = 0x80;
+
+// Custom tile set for text mode
+//
+// The value in this memory location selects the page (the high byte of the address) of a tile set stored in RAM.
+// Writing 0 selects the built-in character set.
+//
+// A tile set contains 128 tiles of 8 bytes each, encoded the same way as the built-in character set: each byte is
+// a row of the tile and the least significant bit is the leftmost pixel.
+static constexpr uint16_t kIOTileSet = 0x917;
+static constexpr size_t kIOTileCount = 128;
+static constexpr size_t kIOTileSize = 8;
+static constexpr size_t kIOTileSetSize = kIOTileCount * kIOTileSize;
+
+// Palette
+//
+// The palette contains 256 24-bit colors and is used to display VRAM if the palette flag in the control byte is set.
+// It is initialized with the colors of the regular rrrgggbb encoding.
+//
+// Writing to kIOPaletteIndex selects the palette entry that is being programmed. Each entry is then programmed by
+// writing its red, green and blue components, in that order, to kIOPaletteData. After the blue component has been
+// written, the index advances to the next entry, so consecutive entries can be programmed without selecting them.
+//
+// Changes to the palette are visible the next time a frame is presented, VRAM does not need to be rewritten.
+static constexpr uint16_t kIOPaletteIndex = 0x918;
+static constexpr uint16_t kIOPaletteData = 0x919;
+static constexpr size_t kIOPaletteDataSize = 256 * 3;
+static constexpr size_t kIOPalettePageCount = (kIOPaletteDataSize + kSnapshotPageSize - 1) / kSnapshotPageSize;
+
+// Video synchronisation
+//
+// If the VBLANK interrupt is enabled, the IOChip interrupts the CPU each time a frame has been presented, with the
+// kIOEventVBlank event type. Guests can use this to run their game loop once per displayed frame.
+//
+// If double buffering is enabled, the display shows a separate front buffer instead of VRAM. Guests draw into VRAM
+// (the back buffer) and request a flip by setting the flip bit. At the start of the next frame, VRAM is copied to
+// the front buffer as a whole and the flip bit is cleared again, so guests can poll it to find out if the flip
+// has happened. After enabling double buffering, guests should request a flip to initialize the front buffer.
+// The flip bit is ignored while double buffering is disabled.
+//
+// VideoSync: 0 00000 0 0
+//            ^ ^     ^ ^
+//            | |     | |
+//            | |     | +- Double buffering enabled
+//            | |     +--- VBLANK interrupt enabled
+//            | +--------- Reserved for future expansion
+//            +----------- Flip requested
+static constexpr uint16_t kIOVideoSync = 0x91A;
+static constexpr uint8_t kIOVideoSyncDoubleBuffer = 0x01;
+static constexpr uint8_t kIOVideoSyncVBlank = 0x02;
+static constexpr uint8_t kIOVideoSyncFlip = 0x80;
+
+// Event queue
+//
+// If the event queue flag in the control byte is set, events no longer overwrite each other. Instead they are
+// queued up and the oldest pending event is presented in the event type and payload memory locations. Writing any
+// value to kIOEventAck removes that event from the queue and presents the next one. As long as events are pending,
+// the IOChip interrupts the CPU again after each acknowledgement, so an interrupt handler can service a single
+// event and return.
+//
+// Reading kIOEventAck returns the amount of pending events, including the presented one. If events had to be
+// dropped because the queue was full, the overflow bit is set until the queue has been drained.
+//
+// EventAck: 0 0000000
+//           ^ ^
+//           | |
+//           | +- Amount of pending events
+//           +--- Events were dropped
+static constexpr uint16_t kIOEventAck = 0x91B;
+static constexpr uint8_t kIOEventAckOverflow = 0x80;
+static constexpr size_t kIOEventQueueSize = 32;
+
+// Interrupt controller
+//
+// Every event belongs to one of the interrupt sources below. Sources whose bit is cleared in kIOInterruptMask are
+// masked, their events are dropped and don't interrupt the CPU. All sources are enabled after a reset.
+//
+// Sources whose bit is set in kIOInterruptPriority are high priority. If the event queue is enabled, their events
+// are presented before any pending low priority event. The presented event itself is never displaced.
+//
+// The value in kIOInterruptVectors selects the page (the high byte of the address) of an interrupt vector table
+// stored in RAM. The table contains a 16-bit handler address for each event type, indexed by the event code. When
+// the CPU services an IRQ, it jumps straight to the handler of the presented event, so the handler doesn't have to
+// find out which source interrupted it. Entries containing 0 and a page of 0 fall back to the regular IRQ vector.
+// IRQs raised by other devices on the bus always use the regular IRQ vector.
+//
+// Interrupt sources: 0 0 0 0 0 0 0 0
+//                    ^ ^ ^ ^ ^ ^ ^ ^
+//                    | | | | | | | |
+//                    | | | | | | | +- Keyboard events
+//                    | | | | | | +--- Mouse events
+//                    | | | | | +----- Clock 1
+//                    | | | | +------- Clock 2
+//                    | | | +--------- Timers
+//                    | | +----------- Counters
+//                    | +------------- VBLANK
+//                    +--------------- Reserved for future expansion
+static constexpr uint16_t kIOInterruptMask = 0x91C;
+static constexpr uint16_t kIOInterruptPriority = 0x91D;
+static constexpr uint16_t kIOInterruptVectors = 0x91E;
+static constexpr uint8_t kIOInterruptKeyboard = 0x01;
+static constexpr uint8_t kIOInterruptMouse = 0x02;
+static constexpr uint8_t kIOInterruptClock1 = 0x04;
+static constexpr uint8_t kIOInterruptClock2 = 0x08;
+static constexpr uint8_t kIOInterruptTimer = 0x10;
+static constexpr uint8_t kIOInterruptCounter = 0x20;
+static constexpr uint8_t kIOInterruptVBlank = 0x40;
+static constexpr size_t kIOInterruptVectorCount = 16;
+
 // Reserved for future expansion
-static constexpr uint16_t kIOReserved7 = 0x916;
-static constexpr uint16_t kIOReserved8 = 0x917;
-static constexpr uint16_t kIOReserved9 = 0x918;
-static constexpr uint16_t kIOReserved10 = 0x919;
-static constexpr uint16_t kIOReserved11 = 0x91A;
-static constexpr uint16_t kIOReserved12 = 0x91B;
-static constexpr uint16_t kIOReserved13 = 0x91C;
-static constexpr uint16_t kIOReserved14 = 0x91D;
-static constexpr uint16_t kIOReserved15 = 0x91E;
 static constexpr uint16_t kIOReserved16 = 0x91F;
 
 // Interrupt event codes
@@ -259,14 +432,15 @@ static constexpr uint8_t kIOEventTimer1 = 0x08;
 static constexpr uint8_t kIOEventTimer2 = 0x09;
 static constexpr uint8_t kIOEventCounter1 = 0x0A;
 static constexpr uint8_t kIOEventCounter2 = 0x0B;
+static constexpr uint8_t kIOEventVBlank = 0x0C;
 
 // Misc. IO control flags
 //
 // IO + 0x900: 0 0 0 0 1 1 0 0
 //             ^ ^ ^ ^ ^ ^ ^ ^
 //             | | | | | | | |
-//             | | | | | | | +- Reserved for future expansion
-//             | | | | | | +--- Reserved for future expansion
+//             | | | | | | | +- RGB or palette colors
+//             | | | | | | +--- Overwrite or queue events
 //             | | | | | +----- Enable / Disable the mouse
 //             | | | | +------- Enable / Disable the keyboard
 //             | | | +--------- Landscape / Portrait layout
@@ -279,6 +453,8 @@ static constexpr uint8_t kIOControlFullscreen = 0x20;
 static constexpr uint8_t kIOControlOrientation = 0x10;
 static constexpr uint8_t kIOControlKeyboardDisabled = 0x08;
 static constexpr uint8_t kIOControlMouseDisabled = 0x04;
+static constexpr uint8_t kIOControlEventQueue = 0x02;
+static constexpr uint8_t kIOControlPalette = 0x01;
 
 // 1 byte RGB value
 struct ColorValue {
@@ -304,6 +480,54 @@ struct ColorValue {
   }
 };
 
+// Entry in the sprite table
+struct SpriteEntry {
+  uint8_t x;
+  uint8_t y;
+  uint8_t w;
+  uint8_t h;
+  uint8_t data_lo;
+  uint8_t data_hi;
+  uint8_t color_key;
+  uint8_t flags;
+};
+static_assert(sizeof(SpriteEntry) == kIOSpriteEntrySize, "sprite table entries need to be packed");
+
+// Slots of the timer scheduler, one per hardware clock, timer and counter
+enum {
+  kIOTimerSlotClock1 = 0,
+  kIOTimerSlotClock2 = 1,
+  kIOTimerSlotTimer1 = 2,
+  kIOTimerSlotTimer2 = 3,
+  kIOTimerSlotCounter1 = 4,
+  kIOTimerSlotCounter2 = 5,
+  kIOTimerSlotCount = 6,
+};
+
+// A clock, timer or counter waiting to interrupt the CPU
+//
+// Deadlines and periods are measured in ticks. Ticks are nanoseconds of the steady clock, or
+// CPU clock cycles if the bus is in virtual time mode.
+struct TimerSlot {
+  bool armed = false;
+  uint64_t deadline = 0;
+
+  // Time between two interrupts, one-shot timers are disarmed after firing instead
+  uint64_t period = 0;
+  bool periodic = false;
+
+  uint16_t address = 0;
+  uint8_t event_type = kIOEventUnspecified;
+};
+
+// Event waiting to be serviced by the CPU
+struct IOEvent {
+  uint8_t type;
+  uint8_t payload1;
+  uint8_t payload2;
+  bool high_priority;
+};
+
 // Draw instruction telling the drawing thread what to do
 struct DrawInstruction {
   uint8_t method_code;
@@ -313,6 +537,39 @@ struct DrawInstruction {
   uint8_t arg4;
 };
 
+// Copy of the IO chip taken by IOChip::save_golden
+//
+// Timer deadlines are stored as the time remaining when the golden state was saved.
+struct IOGoldenState {
+  uint8_t memory[0x920];
+  uint8_t front_vram[kIOVRAMSize];
+  uint8_t palette_data[kIOPaletteDataSize];
+  bool flip_pending;
+  bool window_requested;
+
+  uint8_t palette_index;
+  uint8_t palette_component;
+  uint8_t brush_body_color;
+  uint8_t brush_outline_color;
+  uint8_t brush_origin_x;
+  uint8_t brush_origin_y;
+  uint16_t brush_source;
+  uint8_t brush_stride;
+  uint8_t brush_key;
+  bool brush_key_enabled;
+  uint8_t mouse_pixel_x;
+  uint8_t mouse_pixel_y;
+
+  IOEvent event_queue[kIOEventQueueSize];
+  size_t event_queue_head;
+  size_t event_queue_size;
+  bool event_queue_overflow;
+  bool irq_pending;
+
+  std::queue<DrawInstruction> draw_pipeline;
+  TimerSlot timer_slots[kIOTimerSlotCount];
+};
+
 // Decodes the audio channel bytes into its components
 class AudioChannelSettingsDecoder {
 public:
@@ -352,36 +609,286 @@ public:
   IOChip(uint16_t maddr);
   ~IOChip();
 
+  // Runs the event loop of the window
+  //
+  // Subsystems are initialized once the guest first uses them: audio on the first write to
+  // an audio channel, the timer scheduler once a clock, timer or counter is armed and the
+  // drawing thread on the first draw instruction. The window is opened once the guest first
+  // writes to VRAM or to a display register, until then this method only waits. Guests which
+  // never touch the display don't get a window at all, in which case start() returns once
+  // cpu_halted() has been called.
   void start();
   void stop();
+  void cpu_halted();
+
+  // Single-threaded operation
+  //
+  // Instead of calling start(), the chip can be driven from the thread running the CPU.
+  // Virtual time is enabled on the bus, so the clocks, timers and counters are advanced
+  // by the CPU. Draw instructions are executed as soon as they are written. Window events,
+  // presenting a frame, page flips and the VBLANK interrupt are handled by calling
+  // run_frame() between slices of CPU execution.
+  //
+  // A headless chip never opens a window or an audio device.
+  void start_single_threaded(bool headless);
+  void run_frame();
+  inline bool is_running() {
+    return !this->shutdown;
+  }
+
+  // Offline audio
+  //
+  // Renders the audio channels into a sample buffer instead of playing them, no audio device
+  // is opened. Requires virtual time: register writes are timestamped with the CPU cycle they
+  // happen at, so the output only depends on the program and is rendered as fast as the CPU
+  // runs. render_offline_audio() appends all samples up to the current cycle to samples.
+  //
+  // Starting offline audio again has no effect, audio streaming to the device is replaced.
+  void start_offline_audio();
+  void render_offline_audio(std::vector<sf::Int16>& samples);
+
+  // Raises a keyboard event as if it came from the window, used to drive headless chips
+  //
+  // Dropped if the keyboard is disabled, just like events from the window.
+  void inject_key(uint8_t type, uint8_t keycode, uint8_t modifiers);
+
+  // Raises an event recorded from the window or inject_key() while a log is replayed
+  void inject_event(uint8_t type, uint8_t payload1, uint8_t payload2);
+
   void write(uint16_t address, uint8_t value);
   uint8_t read(uint16_t address);
+  uint64_t advance(uint64_t cycle);
+  uint16_t interrupt_vector();
+
+  // Captures registers, VRAM, the palette, brush state, pending events, draw instructions and timers.
+  // Timers are stored relative to the current time, so they keep their remaining time when restored.
+  void snapshot(SnapshotWriter& writer);
+  void restore(SnapshotReader& reader);
+
+  // VRAM and the front buffer are tracked in pages, everything else is always captured.
+  // Draw instructions mark all of VRAM, unchanged pages are filtered out when capturing.
+  void snapshot_delta(SnapshotWriter& writer);
+  void restore_delta(SnapshotReader& reader, bool undo_pages, bool restore_state);
+
+  // Keeps a copy of the chip. VRAM, the front buffer and the palette are tracked in pages, resetting
+  // only puts back the pages modified since the golden state was saved.
+  void save_golden(SnapshotWriter& writer);
+  void restore_golden(SnapshotReader& reader);
 
 private:
-  // Prepares the audio buffers for the different wave functions
-  void load_audio_buffers();
-  sf::SoundBuffer audio_buffer_sine;
-  sf::SoundBuffer audio_buffer_square;
-  sf::SoundBuffer audio_buffer_saw;
-  sf::SoundBuffer audio_buffer_triangle;
-  sf::Sound audio_sound1;
-  sf::Sound audio_sound2;
-  sf::Sound audio_sound3;
-  AudioChannelSettingsDecoder audio_cache1;
-  AudioChannelSettingsDecoder audio_cache2;
-  AudioChannelSettingsDecoder audio_cache3;
-
-  // Update one of the currently playing sounds
+  // State which isn't tracked in pages, besides the registers
+  void snapshot_state(SnapshotWriter& writer);
+  void restore_state(SnapshotReader& reader);
+
+  // Convert the palette from and to its serialized form of 3 bytes per entry
+  void get_palette_data(uint8_t* data);
+  void set_palette_data(const uint8_t* data);
+
+  // Contents of VRAM, the front buffer and the palette at the previous incremental snapshot
+  // and the pages modified since then
+  uint8_t vram_shadow[kIOVRAMSize];
+  uint8_t front_vram_shadow[kIOVRAMSize];
+  uint8_t palette_shadow[kIOPaletteDataSize];
+  bool vram_dirty[kIOVRAMPageCount] = {};
+  bool front_vram_dirty[kIOVRAMPageCount] = {};
+  bool palette_dirty[kIOPalettePageCount] = {};
+
+  // Golden state and the pages modified since it was saved, tracked separately from the incremental
+  // snapshots so both can be used at the same time
+  std::unique_ptr<IOGoldenState> golden;
+  bool vram_golden_dirty[kIOVRAMPageCount] = {};
+  bool front_vram_golden_dirty[kIOVRAMPageCount] = {};
+  bool palette_golden_dirty[kIOPalettePageCount] = {};
+
+  // Parts of restoring shared by the snapshots and the golden state
+  //
+  // Timers are scheduled after their slots were restored, with the scheduler mutex held. Audio
+  // continues with the restored channel settings.
+  void schedule_restored_timers();
+  void resume_audio();
+
+  // Starts streaming the synthesizer to the audio device, or stops and destroys the synthesizer
+  //
+  // Both are called with the audio mutex held.
+  void start_audio();
+  void stop_audio();
+  std::mutex audio_mutex;
+  bool audio_loaded = false;
+  bool audio_offline = false;
+  AudioSynth* audio_synth = nullptr;
+  AudioStream* audio_stream = nullptr;
+
+  // Forward a write to an audio channel register to the synthesizer
   void update_audio(uint16_t address, uint8_t value);
 
-  void thread_clock(uint16_t clock_offset);
+  // Sample at which a register write happening right now takes effect
+  //
+  // Writes are delayed by a block of samples, which leaves the synthesizer enough
+  // time to apply them at their exact position in the stream. Offline audio is only
+  // rendered on request, so writes take effect at exactly the current cycle.
+  uint64_t audio_timestamp();
+
+  // Sample of the stream the current time corresponds to, counted from the audio origin
+  //
+  // Streamed audio applies register writes a block after this sample (see audio_timestamp), offline
+  // audio is rendered up to it by render_offline_audio().
+  uint64_t audio_target_sample();
+
+  // Time at which the stream started, in ticks of the scheduler
+  //
+  // It is signed, since restoring a snapshot can move it before the start of the time base.
+  int64_t audio_origin = 0;
+
   void thread_render();
   void thread_drawing();
-  void thread_timer(uint16_t address);
-  void thread_counter(uint16_t address);
+
+  // Interrupts the CPU with an event and its payload
+  //
+  // Called from the event loop, the render thread and the scheduler, so the event
+  // registers and the event queue are protected by the event mutex.
+  void raise_event(uint8_t type, uint8_t payload1 = 0x00, uint8_t payload2 = 0x00);
+  void acknowledge_event();
+  void present_event();
+
+  // Returns the interrupt source bit an event type belongs to
+  uint8_t interrupt_source(uint8_t type);
+
+  // Converts window coordinates into display pixels and raises a mouse event
+  void raise_mouse_event(uint8_t type, int x, int y);
+
+  // Raises an event which came from outside of the machine, see Bus::accept_input
+  void raise_input_event(uint8_t type, uint8_t payload1, uint8_t payload2);
+  uint8_t mouse_pixel_x = 0xFF;
+  uint8_t mouse_pixel_y = 0xFF;
+
+  IOEvent event_queue[kIOEventQueueSize];
+  size_t event_queue_head = 0;
+  size_t event_queue_size = 0;
+  bool event_queue_overflow = false;
+  std::mutex event_mutex;
+
+  // Set while an IRQ raised by the chip hasn't been serviced or acknowledged yet. IRQs raised by other
+  // devices use the regular IRQ vector, even if the chip has vectored interrupts enabled.
+  bool irq_pending = false;
+
+  // Lazy window creation
+  //
+  // The first write to VRAM or a display register requests the window, which is then opened
+  // by the thread running the event loop.
+  bool is_display_address(uint16_t address);
+  void request_window();
+  void open_window();
+  std::atomic<bool> window_requested;
+  bool halted = false;
+  bool headless = false;
+  std::mutex window_mutex;
+  std::condition_variable condition_window;
+
+  // Window event handling, shared by the event loop and run_frame()
+  void handle_event(sf::Event& event);
+
+  // Presents a single frame to the window
+  void render_frame();
+  void commit_flip();
+  void raise_vblank();
+
+  // Executes a draw instruction on VRAM
+  void execute_draw_instruction(const DrawInstruction& instruction);
+  bool single_threaded = false;
+
+  // Single thread serving all clocks, timers and counters
+  //
+  // Each source owns a fixed slot, so (re-)arming one never allocates or spawns a thread.
+  // The thread sleeps until the earliest absolute deadline and periodic sources advance
+  // their deadline by their period, so they don't drift.
+  //
+  // In virtual time mode the thread isn't started, the CPU advances the slots instead.
+  void thread_scheduler();
+  void arm_timer(uint8_t slot, std::chrono::nanoseconds period, bool periodic);
+  void disarm_timer(uint8_t slot);
+  void fire_timer(TimerSlot& slot, uint64_t now);
+  uint64_t fire_due_timers(uint64_t now);
+
+  // Conversion between the time base of the scheduler and wall clock time
+  uint64_t now_ticks();
+  uint64_t to_ticks(std::chrono::nanoseconds duration);
+  std::chrono::nanoseconds from_ticks(uint64_t ticks);
+
+  // Updates the rendering configuration from the control byte
+  void apply_control(uint8_t value);
+
+  TimerSlot timer_slots[kIOTimerSlotCount];
+  std::mutex scheduler_mutex;
+  std::condition_variable condition_scheduler;
+
+  // Copies VRAM into target without ever observing a partially executed draw instruction
+  //
+  // The drawing thread never blocks, instead the copy is retried if a draw instruction
+  // ran while it was being made.
+  void snapshot_vram(uint8_t* target);
+
+  // Draw the snapshot of VRAM to the window
+  void render_graphics_mode(uint32_t screen_width, uint32_t screen_height, uint32_t pixels_row, uint32_t pixels_column);
+  void render_text_mode(uint32_t screen_width, uint32_t screen_height, uint32_t pixels_row, uint32_t pixels_column);
+
+  // Composites the sprite layer on top of a copy of VRAM
+  void render_sprites(uint8_t* frame, uint32_t screen_width, uint32_t screen_height);
+
+  // Rasterizes the current tile set into the tile atlas if it changed since the last frame
+  void update_tile_atlas();
+
+  // RGBA expansion of every 1 byte color value
+  sf::Color color_table[256];
+
+  // Guest programmable palette
+  //
+  // Written by the CPU thread under the palette mutex, the render thread works on a copy
+  sf::Color palette[256];
+  uint8_t palette_index = 0;
+  uint8_t palette_component = 0;
+  std::mutex palette_mutex;
+
+  // Copy of the palette taken at the start of each frame, only accessed by the render thread
+  sf::Color frame_palette[256];
+
+  // Returns the table used to expand 1 byte color values into RGBA, only called by the render thread
+  inline const sf::Color* active_colors() {
+    return this->control & kIOControlPalette ? this->frame_palette : this->color_table;
+  }
+
+  // Front buffer used if double buffering is enabled
+  uint8_t front_vram[kIOVRAMSize];
+  std::atomic<bool> flip_pending;
+
+  // Sequence lock protecting VRAM against torn reads by the render thread
+  //
+  // Odd while the drawing thread executes a draw instruction
+  std::atomic<uint32_t> vram_sequence;
+
+  // Snapshot of the displayed buffer, only accessed by the render thread
+  uint8_t frame[kIOVRAMSize];
+
+  // Graphics mode state, only accessed by the render thread
+  sf::Uint8 frame_pixels[kIOVRAMSize * 4];
+  sf::Texture frame_texture;
+  sf::Sprite frame_sprite;
+  uint32_t frame_width = 0;
+  uint32_t frame_height = 0;
+
+  // Text mode state, only accessed by the render thread
+  //
+  // The atlas holds every tile twice, the second copy with its pixels inverted. Tiles are white and the rest of
+  // the atlas is transparent, so the foreground color is applied via the vertex color and the background color
+  // by clearing the window.
+  uint8_t tile_cache[kIOTileSetSize];
+  bool tile_atlas_loaded = false;
+  sf::Texture tile_atlas;
+  sf::VertexArray tile_vertices;
+  uint32_t tile_vertices_width = 0;
+  uint32_t tile_vertices_height = 0;
 
   union {
-    uint8_t memory[0x910];
+    uint8_t memory[0x920];
     struct {
       uint8_t vram[0x900];
       uint8_t control;
@@ -414,8 +921,8 @@ private:
   sf::RenderWindow* main_window = nullptr;
   std::thread render_thread;
   std::thread drawing_thread;
+  std::thread scheduler_thread;
   std::atomic<bool> shutdown;
-  std::vector<std::thread> worker_threads;
 
   // Rendering configuration
   std::atomic<bool> text_mode;
@@ -433,11 +940,24 @@ private:
   std::atomic<uint8_t> brush_body_color;
   std::atomic<uint8_t> brush_outline_color;
 
+  // Block operation configuration, only accessed by the drawing thread
+  uint8_t brush_origin_x = 0;
+  uint8_t brush_origin_y = 0;
+  uint16_t brush_source = 0;
+  uint8_t brush_stride = 0;
+  uint8_t brush_key = 0;
+  bool brush_key_enabled = false;
+
   // Advanced drawing methods
   void draw_rectangle(uint8_t x, uint8_t y, uint8_t w, uint8_t h);
   void draw_square(uint8_t x, uint8_t y, uint8_t s);
   void draw_dot(uint8_t x, uint8_t y);
   void draw_line(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2);
+  void draw_clear();
+  void draw_fill(uint8_t x, uint8_t y, uint8_t w, uint8_t h);
+  void draw_copy(uint8_t x, uint8_t y, uint8_t w, uint8_t h);
+  void draw_blit(uint8_t x, uint8_t y, uint8_t w, uint8_t h);
+  void draw_scroll(int8_t dx, int8_t dy);
 };
 
 }  // namespace M6502
@@ -0,0 +1,187 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include "bus.h"
+#include "cpu.h"
+#include "machinepool.h"
+
+#pragma once
+
+namespace M6502 {
+
+// Amount of machines a LockstepEngine executes together
+static constexpr size_t kLockstepLanes = 16;
+
+// The lane loops are also compiled for AVX2 (Haswell) and AVX-512 (Skylake), the widest variant the
+// host supports is picked when the program is loaded. Elsewhere they use whatever instruction set the
+// build targets.
+#if defined(LINUX) && defined(__x86_64__)
+#define LOCKSTEP_TARGET_CLONES __attribute__((target_clones("arch=skylake-avx512", "arch=haswell", "default")))
+#else
+#define LOCKSTEP_TARGET_CLONES
+#endif
+
+// Amount of steps a lane waits for the others before it's executed on its own
+static constexpr uint32_t kLockstepPatience = 64;
+
+// Operations and address modes the lockstep engine executes for all lanes at once
+enum {
+  kLockstepFallback = 0,
+  kLockstepLDA,
+  kLockstepLDX,
+  kLockstepLDY,
+  kLockstepSTA,
+  kLockstepSTX,
+  kLockstepSTY,
+  kLockstepADC,
+  kLockstepSBC,
+  kLockstepAND,
+  kLockstepORA,
+  kLockstepEOR,
+  kLockstepBIT,
+  kLockstepCMP,
+  kLockstepCPX,
+  kLockstepCPY,
+  kLockstepINC,
+  kLockstepDEC,
+  kLockstepINX,
+  kLockstepINY,
+  kLockstepDEX,
+  kLockstepDEY,
+  kLockstepTAX,
+  kLockstepTAY,
+  kLockstepTXA,
+  kLockstepTYA,
+  kLockstepCLC,
+  kLockstepSEC,
+  kLockstepNOP,
+  kLockstepJMP,
+  kLockstepBranchSet,
+  kLockstepBranchClear,
+};
+
+enum {
+  kLockstepImplied = 0,
+  kLockstepImmediate,
+  kLockstepZero,
+  kLockstepZeroX,
+  kLockstepZeroY,
+  kLockstepAbsolute,
+  kLockstepAbsoluteX,
+  kLockstepAbsoluteY,
+};
+
+// Experimental engine which executes the machines of a MachinePool in lockstep
+//
+// Machines are executed in groups of kLockstepLanes lanes, with the registers of a group kept in
+// arrays of one element per lane. Each step picks the program counter most of the lanes that haven't
+// used up their cycles yet agree on, and executes the instruction there for all of them. The
+// instruction is decoded once and its register operations are plain loops over the lanes, which the
+// compiler turns into vector instructions (see LOCKSTEP_TARGET_CLONES). Lanes at other addresses are
+// masked out and wait, which lets lanes which took different branches reconverge.
+//
+// Only instructions in ROM are shared, since RAM is different for every lane. Instructions the engine
+// doesn't implement, interrupts and code in RAM fall back to executing the masked lanes one by one
+// on a regular CPU. The operations which are implemented are classified from the CPU dispatch table
+// and mirror the semantics in cpu.cpp, so both produce the same results.
+class LockstepEngine {
+public:
+  LockstepEngine(MachinePool* pool);
+
+  // Same as MachinePool::run_for
+  void run_for(size_t first, size_t last, uint64_t cycles);
+
+  // Amount of instructions executed for all lanes together and by the fallback, per lane
+  uint64_t vector_instructions = 0;
+  uint64_t scalar_instructions = 0;
+
+  // Amount of instructions decoded for all lanes together, vector_instructions / vector_steps is
+  // the average amount of lanes which agreed on the program counter
+  uint64_t vector_steps = 0;
+
+private:
+  struct LockstepInstruction {
+    uint8_t operation;
+    uint8_t mode;
+
+    // Status flag tested by branches
+    uint8_t flag;
+  };
+
+  // Registers and budgets of the machines in a group
+  struct Group {
+    size_t count;
+    alignas(64) uint8_t A[kLockstepLanes];
+    alignas(64) uint8_t X[kLockstepLanes];
+    alignas(64) uint8_t Y[kLockstepLanes];
+    alignas(64) uint8_t SP[kLockstepLanes];
+    alignas(64) uint8_t STATUS[kLockstepLanes];
+    alignas(64) uint8_t flags[kLockstepLanes];
+    alignas(64) uint16_t PC[kLockstepLanes];
+    alignas(64) uint64_t cycles[kLockstepLanes];
+    alignas(64) uint64_t end[kLockstepLanes];
+    alignas(64) uint64_t instructions[kLockstepLanes];
+    uint8_t* ram[kLockstepLanes];
+  };
+
+  void run_group(Group& group);
+
+  // Returns the lane whose program counter is executed next, if the lanes diverged
+  size_t pick_leader(Group& group, const bool* live, const uint32_t* waiting);
+
+  // Executes the instruction at pc for the lanes in mask, returns false if it has to be left to the fallback
+  LOCKSTEP_TARGET_CLONES bool step_vector(Group& group, const bool* mask, uint16_t pc);
+  void step_scalar(Group& group, const bool* mask);
+
+  // Memory of a lane, behaves like the devices of a MachinePool
+  inline uint8_t read(Group& group, size_t lane, uint16_t address) {
+    if (address < this->ram_size)
+      return group.ram[lane][address];
+    if (address >= kAddrROM)
+      return this->pool->get_rom()[address - kAddrROM];
+    return 0x00;
+  }
+  inline void write(Group& group, size_t lane, uint16_t address, uint8_t value) {
+    if (address < this->ram_size)
+      group.ram[lane][address] = value;
+  }
+
+  MachinePool* pool;
+  size_t ram_size;
+  LockstepInstruction table[256];
+
+  // Used by the fallback
+  Bus bus;
+  PoolMemory ram;
+  PoolMemory rom;
+  CPU cpu;
+};
+
+}  // namespace M6502
@@ -0,0 +1,82 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <memory>
+
+#include "bus.h"
+#include "cpu.h"
+#include "iochip.h"
+#include "rammodule.h"
+#include "rommodule.h"
+
+#pragma once
+
+namespace M6502 {
+
+// A complete machine with its own CPU, bus, RAM, IO chip and ROM
+//
+// Machines run single threaded and headless in virtual time (see IOChip::start_single_threaded),
+// so independent machines can run in parallel on different threads.
+//
+// Forking creates a child with the exact state of its parent. The child shares the ROM and all
+// RAM pages with the parent and only copies the pages either of them writes to afterwards, so
+// a single parent can spawn thousands of children cheaply. The CPU registers and the IO chip
+// are copied via their snapshots.
+class Machine {
+public:
+  Machine();
+
+  // The parent must not be running while it is forked. The child can outlive its parent.
+  std::unique_ptr<Machine> fork();
+
+  // Emulate a single frame and let the IO chip present it
+  //
+  // Returns the amount of cycles that were executed
+  uint64_t run_frame();
+
+  // Triggers a reset, which is handled before the next instruction
+  //
+  // The CPU reads the reset vector when it is constructed, before any code could be flashed
+  // into the ROM, so new machines have to be reset once the ROM is set up.
+  void reset();
+
+  // The ROM is shared between forked machines and must not be changed once a machine was forked
+  inline uint8_t* get_rom() {
+    return this->rom->get_buffer();
+  }
+
+  Bus bus;
+  RAMModule<kSizeRAM> ram;
+  IOChip io;
+  std::shared_ptr<ROMModule<kSizeROM>> rom;
+  CPU cpu;
+
+private:
+  Machine(Machine& parent);
+};
+
+}  // namespace M6502
@@ -0,0 +1,143 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "bus.h"
+#include "busdevice.h"
+#include "cpu.h"
+
+#pragma once
+
+namespace M6502 {
+
+// RAM of pooled machines is allocated in pages of this size
+static constexpr size_t kMachinePoolPageSize = 0x100;
+
+// Flags of pooled machines
+static constexpr uint8_t kMachinePoolHalted = 0x01;
+static constexpr uint8_t kMachinePoolReset = 0x02;
+
+// Plain memory, which can be pointed at the memory of a different machine at any time
+//
+// Addresses past the end of the memory read as 0.
+class PoolMemory : public BusDevice {
+public:
+  using BusDevice::BusDevice;
+
+  inline uint8_t read(uint16_t address) {
+    return address < this->size ? this->memory[address] : 0x00;
+  }
+
+  inline void write(uint16_t address, uint8_t value) {
+    if (this->writable && address < this->size)
+      this->memory[address] = value;
+  }
+
+  inline void read_block(uint16_t address, uint8_t* buffer, size_t size) {
+    size_t available = address < this->size ? std::min(size, this->size - address) : 0;
+    std::memcpy(buffer, this->memory + address, available);
+    std::memset(buffer + available, 0, size - available);
+  }
+
+  uint8_t* memory = nullptr;
+  size_t size = 0;
+  bool writable = true;
+};
+
+// Many lightweight machines, stored as a structure of arrays
+//
+// Lightweight machines consist of a CPU, RAM and a ROM shared by all of them. There is no IO chip,
+// the IO range reads as 0 and ignores writes. The registers of all machines are stored in one array
+// per register. Their RAM is allocated from a single arena, in page aligned blocks of ram_size bytes.
+// The arena is only backed by host memory where machines touched it, and RAM starts out zeroed
+// instead of being filled with 0xFF like RAMModule.
+//
+// Machines don't have CPU objects of their own. run_for() loads one machine after another into a
+// single CPU, executes it against the machine's RAM and stores the registers back. The dispatch
+// table is shared by all CPUs anyway.
+class MachinePool {
+public:
+  // The RAM size is rounded up to whole pages and limited to kSizeRAM. If the arena can't be
+  // allocated, the pool is empty.
+  MachinePool(size_t count, size_t ram_size = kSizeRAM);
+  ~MachinePool();
+
+  inline size_t size() {
+    return this->count;
+  }
+
+  inline uint8_t* get_rom() {
+    return this->rom;
+  }
+
+  inline uint8_t* get_ram(size_t index) {
+    return this->arena + index * this->ram_size;
+  }
+
+  inline size_t get_ram_size() {
+    return this->ram_size;
+  }
+
+  // Triggers a reset, which is handled before the next instruction of the machine
+  //
+  // All machines start out with a pending reset, so they pick up the reset vector once the ROM
+  // is set up.
+  void reset(size_t index);
+
+  // Runs the machines in [first, last) for a given amount of cycles each on the calling thread
+  //
+  // Several threads can run disjoint ranges of machines at the same time. Halted machines are skipped.
+  void run_for(size_t first, size_t last, uint64_t cycles);
+
+  // Register files
+  std::vector<uint8_t> A;
+  std::vector<uint8_t> X;
+  std::vector<uint8_t> Y;
+  std::vector<uint8_t> SP;
+  std::vector<uint16_t> PC;
+  std::vector<uint8_t> STATUS;
+  std::vector<uint64_t> cycles;
+  std::vector<uint64_t> instructions;
+  std::vector<uint8_t> flags;
+
+private:
+  void load(CPU& cpu, size_t index);
+  void store(CPU& cpu, size_t index);
+
+  size_t count;
+  size_t ram_size;
+  size_t arena_size;
+  uint8_t* arena = nullptr;
+  uint8_t rom[kSizeROM] = {};
+};
+
+}  // namespace M6502
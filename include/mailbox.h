@@ -0,0 +1,106 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdint>
+#include <mutex>
+
+#include "bus.h"
+#include "busdevice.h"
+#include "snapshot.h"
+
+#pragma once
+
+namespace M6502 {
+
+// Mailbox device
+//
+// Lets the cores of a multi-core machine (see Bus::attach_cpu) tell each other apart and signal each
+// other. When attached to the bus, it replaces the last kSizeMailbox bytes of RAM.
+//
+// Semaphores:
+//   Counting semaphores, which start out at 0. Reading a semaphore tries to take it: if its count is
+//   above 0, it is decremented and the read returns 1, otherwise it returns 0. Writing a value gives
+//   the semaphore that many times, saturating at 255. A lock is a semaphore which was given once.
+//
+// Mailboxes:
+//   Every core has a mailbox which queues up to kMailboxDepth messages of 1 byte. Writing to the
+//   mailbox of a core sends a message to it, which is dropped if the mailbox is full. Reading takes
+//   the oldest message out of the mailbox, or returns 0 if it's empty. Sending a message raises an
+//   IRQ on the receiving core if its bit in the interrupt mask is set.
+//
+// Taking a semaphore synchronizes with the core which gave it, and reading a message synchronizes
+// with the core which sent it: the RAM writes that core made beforehand are visible afterwards.
+//
+// Reading the registers via Bus::read_block has no side effects, semaphores return their count and
+// mailboxes their oldest message.
+static constexpr uint16_t kMailboxCoreID = 0x00;
+static constexpr uint16_t kMailboxCoreCount = 0x01;
+static constexpr uint16_t kMailboxStatus = 0x02;
+static constexpr uint16_t kMailboxInterruptMask = 0x03;
+static constexpr uint16_t kMailboxSemaphores = 0x08;
+static constexpr uint16_t kMailboxMessages = 0x10;
+
+static constexpr size_t kMailboxSemaphoreCount = 8;
+static constexpr size_t kMailboxDepth = 16;
+
+// The status and interrupt mask registers have one bit per core
+static_assert(kMaxCores <= 8, "Mailbox registers only have room for 8 cores");
+
+class MailboxDevice : public BusDevice {
+public:
+  MailboxDevice(uint16_t maddr) : BusDevice(maddr) {
+  }
+
+  uint8_t read(uint16_t address);
+  void write(uint16_t address, uint8_t value);
+  void read_block(uint16_t address, uint8_t* buffer, size_t size);
+
+  void snapshot(SnapshotWriter& writer);
+  void restore(SnapshotReader& reader);
+
+private:
+  struct Mailbox {
+    uint8_t messages[kMailboxDepth];
+    uint8_t head;
+    uint8_t count;
+  };
+
+  // Returns the contents of a register without taking semaphores or messages
+  //
+  // Must be called with the mutex held
+  uint8_t peek(uint16_t address);
+
+  // Guards the state below. Taking it on every access orders the RAM accesses of the cores around
+  // their semaphore and mailbox accesses.
+  std::mutex mutex;
+
+  uint8_t interrupt_mask = 0;
+  uint8_t semaphores[kMailboxSemaphoreCount] = {};
+  Mailbox mailboxes[kMaxCores] = {};
+};
+
+}  // namespace M6502
@@ -25,31 +25,252 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
+#include <mutex>
+
+#include "snapshot.h"
 
 #pragma once
 
 namespace M6502 {
 
+// RAM is split into pages of this size, which is also the granularity of the dirty tracking
+static constexpr size_t kRAMPageSize = kSnapshotPageSize;
+
+// Reference counted page of RAM, shared between forked modules
+struct RAMPage {
+  std::atomic<uint32_t> references = 1;
+  uint8_t data[kRAMPageSize];
+};
+
 // Regular read/write memory of a given size
+//
+// Memory is kept in pages which can be shared with forked modules. Shared pages are copied
+// the first time they are written to, so forking only copies the page table. Forked modules
+// can be used from different threads.
+//
+// A module can also be shared by multiple cores running on different threads (see Bus::attach_cpu).
+// The page pointers are atomics, and the first write to a shared page swaps in its private copy.
+// Reads load the page pointer relaxed: the data is only reached through the pointer, which orders
+// the read after the copy was made on every host we run on (the guarantee memory_order_consume
+// describes, which compilers implement as a more expensive acquire). Accesses to the bytes themselves
+// aren't ordered between cores at all (see MailboxDevice for how guests synchronize).
 template <size_t C>
 class RAMModule : public BusDevice {
 public:
   RAMModule(uint16_t maddr) : BusDevice(maddr) {
-    std::memset(this->buffer, 0xFF, C);
+    for (size_t i = 0; i < kPageCount; i++) {
+      RAMPage* page = new RAMPage();
+      std::memset(page->data, 0xFF, kRAMPageSize);
+      this->pages[i].store(page, std::memory_order_relaxed);
+      this->owned[i].store(true, std::memory_order_relaxed);
+    }
+  }
+
+  // Creates a module which shares all pages with source
+  RAMModule(uint16_t maddr, RAMModule<C>& source) : BusDevice(maddr) {
+    source.release_retired();
+    for (size_t i = 0; i < kPageCount; i++) {
+      RAMPage* page = source.page(i);
+      page->references.fetch_add(1, std::memory_order_relaxed);
+      this->pages[i].store(page, std::memory_order_relaxed);
+      this->owned[i].store(false, std::memory_order_relaxed);
+      source.owned[i].store(false, std::memory_order_relaxed);
+    }
+  }
+
+  ~RAMModule() {
+    this->release_retired();
+    for (size_t i = 0; i < kPageCount; i++)
+      release(this->page(i));
+    for (RAMPage* page : this->golden) {
+      if (page != nullptr)
+        release(page);
+    }
+    delete[] this->shadow;
   }
 
   uint8_t read(uint16_t address) {
-    return this->buffer[address];
+    return this->page(address / kRAMPageSize)->data[address % kRAMPageSize];
+  }
+
+  void read_block(uint16_t address, uint8_t* buffer, size_t size) {
+    size = std::min(size, C - address);
+    while (size) {
+      size_t offset = address % kRAMPageSize;
+      size_t chunk = std::min(size, kRAMPageSize - offset);
+      std::memcpy(buffer, this->page(address / kRAMPageSize)->data + offset, chunk);
+      address += chunk;
+      buffer += chunk;
+      size -= chunk;
+    }
+  }
+
+  void snapshot(SnapshotWriter& writer) {
+    uint8_t data[C];
+    this->read_block(0, data, C);
+    writer.write_block(data, C);
+  }
+
+  void restore(SnapshotReader& reader) {
+    uint8_t data[C];
+    reader.read_block(data, C);
+    this->store(data);
+
+    // Every page could differ from the previous incremental snapshot now
+    for (std::atomic<bool>& dirty : this->dirty_pages)
+      dirty.store(true, std::memory_order_relaxed);
+  }
+
+  void snapshot_delta(SnapshotWriter& writer) {
+    // The first incremental snapshot has nothing to revert to, it only takes the shadow copy
+    if (this->shadow == nullptr) {
+      this->shadow = new uint8_t[C];
+      this->read_block(0, this->shadow, C);
+      for (std::atomic<bool>& dirty : this->dirty_pages)
+        dirty.store(false, std::memory_order_relaxed);
+    }
+
+    // Only dirty pages are looked at. The flags are taken before the page is copied, so a write
+    // racing with the snapshot marks its page again for the next one.
+    uint8_t data[C];
+    bool dirty[kPageCount];
+    for (size_t i = 0; i < kPageCount; i++) {
+      dirty[i] = this->dirty_pages[i].exchange(false, std::memory_order_relaxed);
+      if (dirty[i])
+        std::memcpy(data + i * kRAMPageSize, this->page(i)->data, kRAMPageSize);
+    }
+    writer.write_pages(data, this->shadow, dirty, C);
+  }
+
+  void restore_delta(SnapshotReader& reader, bool undo_pages, bool) {
+    if (this->shadow == nullptr) {
+      this->shadow = new uint8_t[C];
+      this->read_block(0, this->shadow, C);
+    }
+
+    uint8_t data[C];
+    this->read_block(0, data, C);
+    reader.read_pages(data, this->shadow, C, undo_pages);
+    if (undo_pages)
+      this->store(data);
+  }
+
+  // The golden state holds on to the current pages, so every page written to afterwards gets copied
+  // and differs from its golden counterpart. Only those are put back.
+  void save_golden(SnapshotWriter&) {
+    this->release_retired();
+    for (size_t i = 0; i < kPageCount; i++) {
+      if (this->golden[i] != nullptr)
+        release(this->golden[i]);
+      this->golden[i] = this->page(i);
+      this->golden[i]->references.fetch_add(1, std::memory_order_relaxed);
+      this->owned[i].store(false, std::memory_order_relaxed);
+    }
+  }
+
+  void restore_golden(SnapshotReader&) {
+    this->release_retired();
+    for (size_t i = 0; i < kPageCount; i++) {
+      if (this->page(i) == this->golden[i] || this->golden[i] == nullptr)
+        continue;
+      release(this->page(i));
+      this->golden[i]->references.fetch_add(1, std::memory_order_relaxed);
+      this->pages[i].store(this->golden[i], std::memory_order_relaxed);
+      this->owned[i].store(false, std::memory_order_relaxed);
+      this->dirty_pages[i].store(true, std::memory_order_relaxed);
+    }
   }
 
   void write(uint16_t address, uint8_t value) {
-    this->buffer[address] = value;
+    this->writable_page(address / kRAMPageSize)->data[address % kRAMPageSize] = value;
+    this->dirty_pages[address / kRAMPageSize].store(true, std::memory_order_relaxed);
   }
 
 private:
-  uint8_t buffer[C];
+  static_assert(C % kRAMPageSize == 0, "RAM size has to be a multiple of the page size");
+  static constexpr size_t kPageCount = C / kRAMPageSize;
+
+  inline RAMPage* page(size_t index) {
+    return this->pages[index].load(std::memory_order_relaxed);
+  }
+
+  // Returns the private copy of a page, which is made on the first write after the page got shared
+  //
+  // Whether a page is private is tracked separately instead of looking at its reference count: a core
+  // could be holding on to a page another core just replaced, which might have dropped to a single
+  // reference held by someone else. The flag is only set after the private copy was swapped in.
+  inline RAMPage* writable_page(size_t index) {
+    if (this->owned[index].load(std::memory_order_acquire))
+      return this->page(index);
+    return this->unshare(index);
+  }
+
+  // Cores racing to write to the same shared page have to end up with the same copy, so pages are
+  // unshared one at a time. This only happens once per page after it got shared.
+  RAMPage* unshare(size_t index) {
+    std::unique_lock<std::mutex> lk(this->unshare_mutex);
+    RAMPage* page = this->page(index);
+    if (this->owned[index].load(std::memory_order_relaxed))
+      return page;
+
+    RAMPage* copy = new RAMPage();
+    std::memcpy(copy->data, page->data, kRAMPageSize);
+    this->pages[index].store(copy, std::memory_order_release);
+    this->owned[index].store(true, std::memory_order_release);
+
+    // Other cores might still be reading from the shared page, so it's kept until the cores stopped
+    if (this->retired[index] != nullptr)
+      release(this->retired[index]);
+    this->retired[index] = page;
+    return copy;
+  }
+
+  // Called whenever the cores can't be running, e.g. while pages get shared
+  void release_retired() {
+    for (RAMPage*& page : this->retired) {
+      if (page != nullptr)
+        release(page);
+      page = nullptr;
+    }
+  }
+
+  static void release(RAMPage* page) {
+    if (page->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete page;
+  }
+
+  // Copies the whole contents into the pages, pages which didn't change stay shared
+  void store(const uint8_t* data) {
+    this->release_retired();
+    for (size_t i = 0; i < kPageCount; i++) {
+      if (std::memcmp(this->page(i)->data, data + i * kRAMPageSize, kRAMPageSize) == 0)
+        continue;
+      std::memcpy(this->writable_page(i)->data, data + i * kRAMPageSize, kRAMPageSize);
+    }
+  }
+
+  std::atomic<RAMPage*> pages[kPageCount];
   size_t capacity = C;
+
+  // Set for pages which aren't shared with forks or the golden state
+  std::atomic<bool> owned[kPageCount];
+
+  // Shared pages replaced by their private copy, released once the cores stopped
+  RAMPage* retired[kPageCount] = {};
+  std::mutex unshare_mutex;
+
+  // Pages at the time the golden state was saved
+  RAMPage* golden[kPageCount] = {};
+
+  // Contents at the previous incremental snapshot and the pages written to since then
+  //
+  // The shadow copy is only allocated once incremental snapshots are used. The flags are set by
+  // every core writing to RAM.
+  uint8_t* shadow = nullptr;
+  std::atomic<bool> dirty_pages[kPageCount] = {};
 };
 }  // namespace M6502
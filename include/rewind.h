@@ -0,0 +1,80 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#pragma once
+
+namespace M6502 {
+
+// Forward declarations
+class Bus;
+
+// Rewind buffer
+//
+// Records the machine in a bounded ring of incremental snapshots. Each capture stores the
+// pages modified since the previous capture with the contents they had back then, plus the
+// small remaining state of the CPU and devices. Rewinding walks the captures backwards and
+// writes the old pages back, so its cost depends on how much memory changed, not on the size
+// of the machine.
+//
+// Once the captures occupy more than the given capacity in bytes, the oldest ones are dropped.
+// The CPU must not be running while capturing or rewinding.
+class RewindBuffer {
+public:
+  RewindBuffer(Bus* bus, size_t capacity);
+
+  // Records the current state of the machine, usually once per frame
+  void capture();
+
+  // Returns the machine to the state of the n-th most recent capture, rewind(1) reverts to the
+  // latest one. Captures newer than the restored one are discarded.
+  //
+  // Returns false without changing the machine if there are less than n captures.
+  bool rewind(size_t n);
+
+  // Drops all captures
+  void clear();
+
+  inline size_t size() {
+    return this->captures.size();
+  }
+  inline size_t bytes_used() {
+    return this->used;
+  }
+
+private:
+  Bus* bus;
+  size_t capacity;
+  size_t used = 0;
+  std::deque<std::vector<uint8_t>> captures;
+};
+
+}  // namespace M6502
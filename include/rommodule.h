@@ -25,9 +25,12 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 
+#include "snapshot.h"
+
 #pragma once
 
 namespace M6502 {
@@ -44,6 +47,28 @@ public:
     return this->buffer[address];
   }
 
+  void read_block(uint16_t address, uint8_t* buffer, size_t size) {
+    std::memcpy(buffer, this->buffer + address, std::min(size, C - address));
+  }
+
+  void snapshot(SnapshotWriter& writer) {
+    writer.write_block(this->buffer, C);
+  }
+
+  void restore(SnapshotReader& reader) {
+    reader.read_block(this->buffer, C);
+  }
+
+  // The guest can't modify ROM, so it is left out of incremental snapshots
+  void snapshot_delta(SnapshotWriter&) {
+  }
+  void restore_delta(SnapshotReader&, bool, bool) {
+  }
+  void save_golden(SnapshotWriter&) {
+  }
+  void restore_golden(SnapshotReader&) {
+  }
+
   inline uint8_t* get_buffer() {
     return this->buffer;
   }
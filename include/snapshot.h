@@ -0,0 +1,162 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#pragma once
+
+namespace M6502 {
+
+// Machine snapshots
+//
+// A snapshot starts with a header, followed by one section per component of the machine.
+// All values are stored little endian.
+//
+//   +0 magic "M65S"
+//   +4 format version (16-bit)
+//   +6 sections
+//
+// Every section starts with a 1 byte id and the 32-bit size of its payload, which lets a
+// reader verify it consumed exactly what the writer produced.
+//
+// Memory blocks are run-length encoded. Each packet starts with a control byte:
+//
+// Control: 0 0000000
+//          ^ ^
+//          | |
+//          | +- Length
+//          +--- Run or literal packet
+//
+// A literal packet is followed by length + 1 bytes which are copied as is. A run packet is
+// followed by a single byte which is repeated length + 2 times. Untouched memory mostly
+// consists of long runs of the same value, which compress to 2 bytes every 129 bytes.
+static constexpr uint8_t kSnapshotMagic[4] = {'M', '6', '5', 'S'};
+static constexpr uint16_t kSnapshotVersion = 1;
+static constexpr uint8_t kSnapshotRun = 0x80;
+static constexpr size_t kSnapshotMaxRun = 0x7F + 2;
+static constexpr size_t kSnapshotMaxLiteral = 0x7F + 1;
+
+// Incremental snapshots
+//
+// Incremental snapshots track memory in pages. A list of pages is stored as a 16-bit count, followed
+// by the 16-bit index and the run-length encoded contents of each page.
+static constexpr size_t kSnapshotPageSize = 256;
+
+// Section ids
+//
+// The CPU section holds the registers of all cores attached to the bus, in order.
+static constexpr uint8_t kSnapshotSectionCPU = 0x01;
+static constexpr uint8_t kSnapshotSectionRAM = 0x02;
+static constexpr uint8_t kSnapshotSectionIO = 0x03;
+static constexpr uint8_t kSnapshotSectionROM = 0x04;
+static constexpr uint8_t kSnapshotSectionInput = 0x05;
+static constexpr uint8_t kSnapshotSectionMailbox = 0x06;
+
+// Serializes machine state into a snapshot
+class SnapshotWriter {
+public:
+  SnapshotWriter();
+
+  void write_byte(uint8_t value);
+  void write_word(uint16_t value);
+  void write_long(uint32_t value);
+  void write_quad(uint64_t value);
+
+  // Writes a run-length encoded memory block
+  void write_block(const uint8_t* buffer, size_t size);
+
+  // Writes the pages marked as dirty with the contents they have in shadow, which holds the
+  // contents of the buffer at the previous incremental snapshot. Afterwards the shadow is brought
+  // up to date and the dirty marks are cleared. Pages which were changed back to their previous
+  // contents are skipped.
+  void write_pages(const uint8_t* buffer, uint8_t* shadow, bool* dirty, size_t size);
+
+  // Sections can't be nested
+  void begin_section(uint8_t id);
+  void end_section();
+
+  inline std::vector<uint8_t>& get_data() {
+    return this->data;
+  }
+
+private:
+  std::vector<uint8_t> data;
+  size_t section_start = 0;
+};
+
+// Deserializes machine state from a snapshot
+//
+// Reading past the end of the snapshot or decoding an invalid block marks the reader as failed,
+// after which all reads return 0. Callers check failed() once they're done, instead of after
+// every single value.
+class SnapshotReader {
+public:
+  SnapshotReader(const uint8_t* data, size_t size);
+
+  // Checks the magic bytes and the version of the snapshot
+  bool read_header();
+
+  uint8_t read_byte();
+  uint16_t read_word();
+  uint32_t read_long();
+  uint64_t read_quad();
+
+  // Decodes a run-length encoded memory block of exactly size bytes
+  void read_block(uint8_t* buffer, size_t size);
+
+  // Reads a list of pages written by SnapshotWriter::write_pages. If apply is set, the pages
+  // are copied into buffer and shadow, otherwise they are skipped.
+  void read_pages(uint8_t* buffer, uint8_t* shadow, size_t size, bool apply);
+
+  // Returns false if the next section doesn't have the expected id
+  bool begin_section(uint8_t id);
+
+  // Returns false if the section wasn't consumed completely
+  bool end_section();
+
+  // Continues after the end of the current section, even if it wasn't consumed completely
+  void skip_section();
+
+  inline bool failed() {
+    return this->error;
+  }
+
+private:
+  const uint8_t* data;
+  size_t size;
+  size_t position = 0;
+  size_t section_end = 0;
+  bool error = false;
+};
+
+// Store and load snapshots on disk, return false if the file couldn't be accessed
+bool save_snapshot(const std::string& path, const std::vector<uint8_t>& data);
+bool load_snapshot(const std::string& path, std::vector<uint8_t>& data);
+
+}  // namespace M6502
@@ -0,0 +1,92 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+namespace M6502 {
+
+// Fixed size pool of worker threads with work stealing
+//
+// Every worker has its own queue. Jobs submitted from inside a worker go to the back of its own queue
+// and are picked up by the same worker first, which keeps jobs resubmitting their continuation on
+// the same core. Jobs submitted from other threads are distributed round robin. Workers running out
+// of jobs steal the oldest job from the other queues. Used to run forked machines and batches of
+// machines in parallel.
+class ThreadPool {
+public:
+  ThreadPool(size_t thread_count = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  void submit(std::function<void()> job);
+
+  // Blocks until all submitted jobs have finished, including the ones they submitted
+  void wait();
+
+  inline size_t size() {
+    return this->workers.size();
+  }
+
+private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> jobs;
+  };
+
+  void thread_worker(size_t index);
+
+  // Takes a job from the back of the own queue or the front of another one, returns false if all
+  // queues are empty
+  bool take_job(size_t index, std::function<void()>& job);
+
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::atomic<size_t> next_queue = 0;
+
+  // Amount of jobs waiting in the queues
+  std::atomic<size_t> queued = 0;
+
+  // Workers sleep while all queues are empty
+  std::mutex idle_mutex;
+  std::condition_variable condition_jobs;
+  std::condition_variable condition_idle;
+
+  // Amount of jobs which were submitted but haven't finished yet
+  size_t pending = 0;
+  bool shutdown = false;
+};
+
+}  // namespace M6502
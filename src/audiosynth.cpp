@@ -0,0 +1,204 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include "audiosynth.h"
+
+namespace M6502 {
+
+// Fractional part of a non-negative phase
+//
+// Truncating via an integer conversion vectorizes on every SSE2 target, unlike std::floor
+static inline float phase_fraction(float t) {
+  return t - static_cast<float>(static_cast<int>(t));
+}
+
+void AudioSynth::write(uint64_t sample, uint8_t channel, uint8_t value) {
+  std::unique_lock<std::mutex> lk(this->events_mutex);
+  this->events.push_back({sample, channel, value});
+}
+
+void AudioSynth::render(sf::Int16* buffer, size_t count) {
+  float mix[kIOAudioBlockSize];
+
+  while (count > 0) {
+    size_t block_size = std::min(count, kIOAudioBlockSize);
+    uint64_t position = this->rendered;
+    uint64_t block_end = position + block_size;
+
+    // Split the block at every register write falling into it
+    size_t offset = 0;
+    while (offset < block_size) {
+      uint64_t span_end = block_end;
+      {
+        std::unique_lock<std::mutex> lk(this->events_mutex);
+        while (!this->events.empty() && this->events.front().sample <= position + offset) {
+          this->apply(this->events.front());
+          this->events.pop_front();
+        }
+        if (!this->events.empty())
+          span_end = std::min(span_end, this->events.front().sample);
+      }
+
+      size_t span = span_end - (position + offset);
+      this->mix_span(mix + offset, span);
+      offset += span;
+    }
+
+    for (size_t i = 0; i < block_size; i++)
+      buffer[i] = static_cast<sf::Int16>(std::clamp(mix[i], -32767.0f, 32767.0f));
+
+    this->rendered = block_end;
+    buffer += block_size;
+    count -= block_size;
+  }
+}
+
+void AudioSynth::apply(const AudioEvent& event) {
+  if (event.channel >= kIOAudioChannelCount)
+    return;
+
+  AudioChannelSettingsDecoder decoder(event.value);
+  AudioOscillator& oscillator = this->oscillators[event.channel];
+
+  // The phase is kept, so changing the pitch or the wave function doesn't click
+  oscillator.increment = kIOAudioBaseFrequency * decoder.pitch / kIOAudioSampleRate;
+  oscillator.amplitude = (kIOAudioAmplitude / kIOAudioChannelCount) * decoder.volume / 100.0f;
+  oscillator.wave_function = decoder.wave_function;
+}
+
+void AudioSynth::mix_span(float* mix, size_t count) {
+  std::fill(mix, mix + count, 0.0f);
+
+  for (AudioOscillator& oscillator : this->oscillators) {
+    if (oscillator.amplitude == 0.0f)
+      continue;
+
+    // The loops count with a signed 32-bit index, which converts to float in vector registers
+    int span = static_cast<int>(count);
+    float phase = oscillator.phase;
+    float increment = oscillator.increment;
+    float amplitude = oscillator.amplitude;
+
+    switch (oscillator.wave_function) {
+      case kIOAudioChannelWaveSine: {
+        // Parabolic approximation of sin(2 pi t), accurate to about 0.1%
+        for (int i = 0; i < span; i++) {
+          float t = phase + static_cast<float>(i) * increment;
+          float p = 1.0f - 2.0f * phase_fraction(t);
+          float s = 4.0f * p * (1.0f - std::fabs(p));
+          mix[i] += amplitude * (0.225f * (s * std::fabs(s) - s) + s);
+        }
+        break;
+      }
+      case kIOAudioChannelWaveSquare: {
+        for (int i = 0; i < span; i++) {
+          float t = phase + static_cast<float>(i) * increment;
+          float high = phase_fraction(t) < 0.5f;
+          mix[i] += amplitude * (2.0f * high - 1.0f);
+        }
+        break;
+      }
+      case kIOAudioChannelWaveSaw: {
+        for (int i = 0; i < span; i++) {
+          float t = phase + static_cast<float>(i) * increment;
+          mix[i] += amplitude * (2.0f * phase_fraction(t) - 1.0f);
+        }
+        break;
+      }
+      case kIOAudioChannelWaveTriangle: {
+        for (int i = 0; i < span; i++) {
+          float t = phase + static_cast<float>(i) * increment;
+          mix[i] += amplitude * (1.0f - 4.0f * std::fabs(phase_fraction(t) - 0.5f));
+        }
+        break;
+      }
+    }
+
+    float end = phase + static_cast<float>(count) * increment;
+    oscillator.phase = phase_fraction(end);
+  }
+}
+
+AudioStream::AudioStream(AudioSynth* synth) : synth(synth) {
+  this->initialize(1, kIOAudioSampleRate);
+}
+
+bool AudioStream::onGetData(Chunk& data) {
+  this->synth->render(this->block, kIOAudioBlockSize);
+  data.samples = this->block;
+  data.sampleCount = kIOAudioBlockSize;
+  return true;
+}
+
+void AudioStream::onSeek(sf::Time) {
+  // The stream is generated on the fly and can't be seeked
+}
+
+bool write_wav(const std::string& path, const std::vector<sf::Int16>& samples, uint32_t sample_rate) {
+  std::ofstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+
+  // WAV files are little endian, independent of the host
+  auto write_u32 = [&](uint32_t value) {
+    uint8_t bytes[4] = {static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8),
+                        static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 24)};
+    file.write(reinterpret_cast<const char*>(bytes), 4);
+  };
+  auto write_u16 = [&](uint16_t value) {
+    uint8_t bytes[2] = {static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8)};
+    file.write(reinterpret_cast<const char*>(bytes), 2);
+  };
+
+  uint32_t data_size = samples.size() * sizeof(sf::Int16);
+  file.write("RIFF", 4);
+  write_u32(36 + data_size);
+  file.write("WAVE", 4);
+
+  // PCM, mono, 16 bits per sample
+  file.write("fmt ", 4);
+  write_u32(16);
+  write_u16(1);
+  write_u16(1);
+  write_u32(sample_rate);
+  write_u32(sample_rate * sizeof(sf::Int16));
+  write_u16(sizeof(sf::Int16));
+  write_u16(16);
+
+  file.write("data", 4);
+  write_u32(data_size);
+  for (sf::Int16 sample : samples)
+    write_u16(static_cast<uint16_t>(sample));
+
+  return static_cast<bool>(file);
+}
+
+}  // namespace M6502
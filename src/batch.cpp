@@ -0,0 +1,123 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "batch.h"
+
+namespace M6502 {
+
+// Amount of cycles emulated per frame
+static constexpr uint64_t kBatchFrameCycles = kClockRate / 60;
+
+BatchRunner::BatchRunner(size_t thread_count) : pool(thread_count) {
+}
+
+std::vector<BatchResult> BatchRunner::run(const std::vector<BatchJob>& jobs) {
+  std::vector<BatchResult> results(jobs.size());
+  std::vector<std::unique_ptr<JobState>> states;
+  states.reserve(jobs.size());
+  this->instructions = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < jobs.size(); i++) {
+    states.push_back(std::make_unique<JobState>());
+    JobState* state = states.back().get();
+    state->job = &jobs[i];
+    state->result = &results[i];
+    this->pool.submit([this, state]() { this->run_slice(state); });
+  }
+  this->pool.wait();
+  this->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  return results;
+}
+
+void BatchRunner::run_slice(JobState* state) {
+  if (state->machine == nullptr)
+    this->start_job(state);
+
+  Machine& machine = *state->machine;
+  CPU& cpu = machine.cpu;
+  uint64_t budget = state->job->instruction_budget;
+
+  size_t frames = 0;
+  while (frames < this->slice_frames) {
+    if (cpu.instructions >= budget || cpu.illegal_opcode || cpu.shutdown) {
+      this->finish_job(state);
+      return;
+    }
+
+    if (cpu.cycles >= state->frame_end) {
+      machine.io.run_frame();
+      state->frame_end = cpu.cycles + kBatchFrameCycles;
+      frames++;
+      continue;
+    }
+
+    // Instructions take at least 2 cycles, so the budget is never exceeded
+    uint64_t remaining = std::min(budget - cpu.instructions, kBatchFrameCycles);
+    cpu.run_for(std::min(state->frame_end - cpu.cycles, remaining * 2));
+  }
+
+  this->pool.submit([this, state]() { this->run_slice(state); });
+}
+
+void BatchRunner::start_job(JobState* state) {
+  state->machine = std::make_unique<Machine>();
+  Machine& machine = *state->machine;
+
+  const std::vector<uint8_t>& image = state->job->image;
+  std::memcpy(machine.get_rom(), image.data(), std::min(image.size(), kSizeROM));
+  machine.reset();
+
+  // The log has no snapshot, so the replay starts from the freshly reset machine
+  state->inputs.records = state->job->inputs;
+  machine.bus.start_replay(&state->inputs);
+  state->frame_end = machine.cpu.cycles + kBatchFrameCycles;
+}
+
+void BatchRunner::finish_job(JobState* state) {
+  Machine& machine = *state->machine;
+  BatchResult& result = *state->result;
+  result.instructions = machine.cpu.instructions;
+  result.cycles = machine.cpu.cycles;
+  result.illegal_opcode = machine.cpu.illegal_opcode;
+
+  for (const BatchOutput& output : state->job->outputs) {
+    std::vector<uint8_t> data(output.size);
+    machine.bus.read_block(output.address, data.data(), data.size());
+    result.outputs.push_back(std::move(data));
+  }
+
+  this->instructions += result.instructions;
+  state->machine.reset();
+}
+
+}  // namespace M6502
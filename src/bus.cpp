@@ -25,11 +25,18 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+
 #include "bus.h"
 #include "cpu.h"
+#include "snapshot.h"
 
 namespace M6502 {
 
+thread_local uint8_t Bus::current_core = 0;
+
 uint8_t Bus::read_byte(uint16_t address) {
   BusDevice* dev = this->resolve_address_to_device(address);
   if (dev == nullptr)
@@ -47,6 +54,32 @@ uint16_t Bus::read_word(uint16_t address) {
   return result;
 }
 
+void Bus::read_block(uint16_t address, uint8_t* buffer, size_t size) {
+  while (size) {
+    // Split the block at device boundaries
+    uint32_t device_end = 0x10000;
+    if (address < kAddrMailbox && this->mailbox != nullptr) {
+      device_end = kAddrMailbox;
+    } else if (address < kAddrIO) {
+      device_end = kAddrIO;
+    } else if (address < kAddrROM) {
+      device_end = kAddrROM;
+    }
+    size_t chunk = std::min(size, static_cast<size_t>(device_end - address));
+
+    BusDevice* dev = this->resolve_address_to_device(address);
+    if (dev == nullptr) {
+      std::memset(buffer, 0, chunk);
+    } else {
+      dev->read_block(address - dev->mapped_address, buffer, chunk);
+    }
+
+    address += chunk;
+    buffer += chunk;
+    size -= chunk;
+  }
+}
+
 void Bus::write_byte(uint16_t address, uint8_t value) {
   BusDevice* dev = this->resolve_address_to_device(address);
   if (dev == nullptr)
@@ -62,9 +95,18 @@ void Bus::write_word(uint16_t address, uint16_t value) {
   dev->write(address - dev->mapped_address + 1, (value >> 8) & 0xFF);
 }
 
-void Bus::attach_cpu(CPU* cpu) {
-  this->cpu = cpu;
+bool Bus::attach_cpu(CPU* cpu) {
+  if (std::find(this->cpus.begin(), this->cpus.end(), cpu) != this->cpus.end())
+    return true;
+  if (this->cpus.size() == kMaxCores)
+    return false;
+
+  // Only the primary core advances the devices
   cpu->bus = this;
+  cpu->core = this->cpus.size();
+  cpu->next_event = cpu->core == 0 ? &this->next_event : &kCycleNever;
+  this->cpus.push_back(cpu);
+  return true;
 }
 
 void Bus::attach_ram(BusDevice* dev) {
@@ -82,24 +124,312 @@ void Bus::attach_rom(BusDevice* dev) {
   dev->bus = this;
 }
 
-void Bus::int_irq() {
-  this->cpu->int_irq = true;
-  this->cpu->cv_int.notify_one();
+void Bus::attach_mailbox(BusDevice* dev) {
+  this->mailbox = dev;
+  dev->bus = this;
+}
+
+void Bus::raise(CPU* cpu, std::atomic<bool> CPU::*line) {
+  // The line is set while holding the mutex, so a core which just found no interrupt pending can't
+  // miss the notification before it goes to sleep
+  {
+    std::unique_lock<std::mutex> lk(cpu->mutex_int);
+    (cpu->*line) = true;
+  }
+  cpu->cv_int.notify_one();
+}
+
+void Bus::int_irq(uint8_t core) {
+  for (CPU* cpu : this->cpus) {
+    if (core == kCoreAll || core == cpu->core)
+      raise(cpu, &CPU::int_irq);
+  }
+}
+
+void Bus::int_nmi(uint8_t core) {
+  if (!this->accept_input(kInputNMI, core))
+    return;
+  for (CPU* cpu : this->cpus) {
+    if (core == kCoreAll || core == cpu->core)
+      raise(cpu, &CPU::int_nmi);
+  }
+}
+
+void Bus::int_res(uint8_t core) {
+  if (!this->accept_input(kInputReset, core))
+    return;
+  for (CPU* cpu : this->cpus) {
+    if (core == kCoreAll || core == cpu->core)
+      raise(cpu, &CPU::int_res);
+  }
+}
+
+uint16_t Bus::irq_vector(uint8_t core) {
+  for (BusDevice* dev : {this->IO, this->RAM, this->ROM}) {
+    if (dev == nullptr || (dev == this->IO && core != 0))
+      continue;
+    uint16_t vector = dev->interrupt_vector();
+    if (vector != 0)
+      return vector;
+  }
+  return this->read_word(kVecIRQ);
+}
+
+std::vector<uint8_t> Bus::snapshot() {
+  SnapshotWriter writer;
+  this->write_sections(writer, [&](BusDevice* device) { device->snapshot(writer); });
+  return std::move(writer.get_data());
+}
+
+bool Bus::restore(const std::vector<uint8_t>& data) {
+  SnapshotReader reader(data.data(), data.size());
+  if (!reader.read_header())
+    return false;
+
+  // Devices reschedule their events while being restored
+  this->next_device_event = kCycleNever;
+  this->next_event = this->next_input;
+
+  return this->read_sections(reader, true, false, [&](BusDevice* device) { device->restore(reader); });
+}
+
+std::vector<uint8_t> Bus::snapshot_delta() {
+  SnapshotWriter writer;
+  this->write_sections(writer, [&](BusDevice* device) { device->snapshot_delta(writer); });
+  return std::move(writer.get_data());
+}
+
+bool Bus::restore_delta(const std::vector<uint8_t>& data, bool undo_pages, bool restore_state) {
+  SnapshotReader reader(data.data(), data.size());
+  if (!reader.read_header())
+    return false;
+
+  if (restore_state) {
+    this->next_device_event = kCycleNever;
+    this->next_event = this->next_input;
+  }
+
+  // Devices may stop reading early if they've got nothing to restore
+  return this->read_sections(reader, restore_state, true, [&](BusDevice* device) {
+    device->restore_delta(reader, undo_pages, restore_state);
+  });
+}
+
+void Bus::save_golden() {
+  SnapshotWriter writer;
+  this->write_sections(writer, [&](BusDevice* device) { device->save_golden(writer); });
+  this->golden = std::move(writer.get_data());
+}
+
+bool Bus::reset_to_golden() {
+  if (this->golden.empty())
+    return false;
+
+  SnapshotReader reader(this->golden.data(), this->golden.size());
+  if (!reader.read_header())
+    return false;
+
+  this->next_device_event = kCycleNever;
+  this->next_event = this->next_input;
+
+  return this->read_sections(reader, true, false, [&](BusDevice* device) { device->restore_golden(reader); });
+}
+
+std::array<std::pair<uint8_t, BusDevice*>, 4> Bus::device_sections() {
+  return {{{kSnapshotSectionRAM, this->RAM},
+           {kSnapshotSectionIO, this->IO},
+           {kSnapshotSectionROM, this->ROM},
+           {kSnapshotSectionMailbox, this->mailbox}}};
+}
+
+void Bus::write_sections(SnapshotWriter& writer, const std::function<void(BusDevice*)>& write_device) {
+  writer.begin_section(kSnapshotSectionCPU);
+  for (CPU* cpu : this->cpus)
+    cpu->snapshot(writer);
+  writer.end_section();
+
+  for (auto& section : this->device_sections()) {
+    if (section.second == nullptr)
+      continue;
+    writer.begin_section(section.first);
+    write_device(section.second);
+    writer.end_section();
+  }
+}
+
+bool Bus::read_sections(SnapshotReader& reader,
+                        bool restore_cpus,
+                        bool partial,
+                        const std::function<void(BusDevice*)>& read_device) {
+  auto finish_section = [&]() {
+    if (!partial)
+      return reader.end_section();
+    reader.skip_section();
+    return !reader.failed();
+  };
+
+  // The CPU goes first, so devices can restore their events relative to its cycle count
+  if (!reader.begin_section(kSnapshotSectionCPU))
+    return false;
+  if (restore_cpus) {
+    for (CPU* cpu : this->cpus)
+      cpu->restore(reader);
+  }
+  if (!finish_section())
+    return false;
+
+  for (auto& section : this->device_sections()) {
+    if (section.second == nullptr)
+      continue;
+    if (!reader.begin_section(section.first))
+      return false;
+    read_device(section.second);
+    if (!finish_section())
+      return false;
+  }
+
+  return true;
+}
+
+bool Bus::start_recording(InputLog* log) {
+  if (!this->virtual_time)
+    return false;
+
+  log->snapshot = this->snapshot();
+  log->records.clear();
+  log->end_cycle = this->current_cycle();
+  this->record_log = log;
+  this->record_frame = 0;
+  return true;
+}
+
+void Bus::stop_recording() {
+  if (this->record_log == nullptr)
+    return;
+  this->record_log->end_cycle = this->current_cycle();
+  this->record_log = nullptr;
+}
+
+bool Bus::start_replay(InputLog* log) {
+  if (!this->virtual_time)
+    return false;
+
+  this->stop_replay();
+  if (!log->snapshot.empty() && !this->restore(log->snapshot))
+    return false;
+
+  this->replay_log = log;
+  this->replay_position = 0;
+  this->replay_frame = 0;
+  this->schedule_input();
+  return true;
+}
+
+void Bus::stop_replay() {
+  this->replay_log = nullptr;
+  this->next_input = kCycleNever;
+  this->next_event = this->next_device_event;
+}
+
+bool Bus::accept_input(uint8_t kind, uint8_t type, uint8_t payload1, uint8_t payload2) {
+  if (this->replay_log != nullptr && !this->delivering_input)
+    return false;
+  if (this->record_log != nullptr)
+    this->record_log->record(this->current_cycle(), this->record_frame, kind, type, payload1, payload2);
+  return true;
+}
+
+void Bus::replay_inputs(uint64_t cycle) {
+  const std::vector<InputRecord>& records = this->replay_log->records;
+
+  this->delivering_input = true;
+  while (this->replay_position < records.size() && this->input_due(records[this->replay_position], cycle)) {
+    const InputRecord& record = records[this->replay_position++];
+    switch (record.kind) {
+      case kInputEvent: {
+        if (this->IO != nullptr)
+          this->IO->inject_event(record.type, record.payload1, record.payload2);
+        break;
+      }
+      case kInputNMI: {
+        this->int_nmi(record.type);
+        break;
+      }
+      case kInputReset: {
+        this->int_res(record.type);
+        break;
+      }
+    }
+  }
+  this->delivering_input = false;
+
+  this->schedule_input();
+}
+
+bool Bus::input_due(const InputRecord& record, uint64_t cycle) {
+  // The CPU doesn't run past the end of the frame an input arrived in if the run matches the recording
+  return record.cycle < cycle || (record.cycle == cycle && record.frame <= this->replay_frame);
+}
+
+void Bus::schedule_input() {
+  const std::vector<InputRecord>& records = this->replay_log->records;
+  if (this->replay_position == records.size()) {
+    this->next_input = kCycleNever;
+  } else {
+    // Inputs of a later frame are rescheduled once the current frame ended
+    const InputRecord& record = records[this->replay_position];
+    this->next_input = record.frame > this->replay_frame ? record.cycle + 1 : record.cycle;
+  }
+  this->next_event = std::min(this->next_device_event, this->next_input);
+}
+
+void Bus::end_frame() {
+  if (this->record_log != nullptr)
+    this->record_frame++;
+
+  // Inputs which arrived after the end of the frame are delivered once the CPU continues
+  if (this->replay_log != nullptr) {
+    this->replay_inputs(this->current_cycle());
+    this->replay_frame++;
+    this->schedule_input();
+  }
+}
+
+void Bus::enable_virtual_time() {
+  this->virtual_time = true;
+}
+
+uint64_t Bus::current_cycle() {
+  return this->cpus.front()->cycles;
 }
 
-void Bus::int_nmi() {
-  this->cpu->int_nmi = true;
-  this->cpu->cv_int.notify_one();
+void Bus::advance(uint64_t cycle) {
+  // Device events go first, as they were processed before the CPU finished the slice the
+  // replayed inputs arrived after
+  if (cycle >= this->next_device_event)
+    this->advance_devices(cycle);
+  if (cycle >= this->next_input)
+    this->replay_inputs(cycle);
+  this->next_event = std::min(this->next_device_event, this->next_input);
 }
 
-void Bus::int_res() {
-  this->cpu->int_res = true;
-  this->cpu->cv_int.notify_one();
+void Bus::advance_devices(uint64_t cycle) {
+  // Devices may schedule new events while they're advanced, so the minimum is
+  // combined with whatever got scheduled during the loop
+  this->next_device_event = kCycleNever;
+  for (BusDevice* dev : {this->RAM, this->IO, this->ROM, this->mailbox}) {
+    if (dev != nullptr)
+      this->next_device_event = std::min(this->next_device_event, dev->advance(cycle));
+  }
+  this->next_event = std::min(this->next_device_event, this->next_input);
 }
 
 BusDevice* Bus::resolve_address_to_device(uint16_t address) {
-  if (address < kAddrIO)
+  if (address < kAddrIO) {
+    if (address >= kAddrMailbox && this->mailbox != nullptr)
+      return this->mailbox;
     return this->RAM;
+  }
   if (address >= kAddrROM)
     return this->ROM;
   return this->IO;
@@ -25,36 +25,49 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
+#include <mutex>
 #include <thread>
 
 #include "cpu.h"
+#include "snapshot.h"
 
 #define DEFINE_OPCODE(HEXCODE, OPNAME, ADDRMODE) \
   instruction.addr = &CPU::addr_##ADDRMODE;      \
   instruction.code = &CPU::op_##OPNAME;          \
-  this->dispatch_table[HEXCODE] = instruction
+  dispatch_table[HEXCODE] = instruction
 
 namespace M6502 {
 
+CPU::Instruction CPU::dispatch_table[256];
+static std::once_flag dispatch_table_filled;
+
 CPU::CPU(Bus* b) : bus(b) {
   bus->attach_cpu(this);
+  std::call_once(dispatch_table_filled, &CPU::fill_dispatch_table);
 
+  // Initialize internal status fields
+  this->cycles = 0;
+  this->instructions = 0;
+  this->illegal_opcode = false;
+  this->shutdown = false;
+  this->int_irq = false;
+  this->int_nmi = false;
+  this->int_res = false;
+
+  this->handle_res();
+}
+
+void CPU::fill_dispatch_table() {
   Instruction instruction;
 
   // Prefill dispatch table with illegal opcode handlers
   instruction.addr = &CPU::addr_implied;
   instruction.code = &CPU::op_illegal;
   for (int i = 0; i < 256; i++) {
-    this->dispatch_table[i] = instruction;
+    dispatch_table[i] = instruction;
   }
 
-  // Initialize internal status fields
-  this->illegal_opcode = false;
-  this->shutdown = false;
-  this->int_irq = false;
-  this->int_nmi = false;
-  this->int_res = false;
-
   // Fill all valid opcodes
   //
   // Table taken from https://nesdev.com/6502.txt
@@ -226,11 +239,11 @@ CPU::CPU(Bus* b) : bus(b) {
   DEFINE_OPCODE(0xF9, sbc, y_indexed);
   DEFINE_OPCODE(0xFD, sbc, x_indexed);
   DEFINE_OPCODE(0xFE, inc, x_indexed);
-
-  this->handle_res();
 }
 
 void CPU::start() {
+  Bus::current_core = this->core;
+
   // Run instructions until we encounter an illegal one
   // In that case we just return and let the caller
   // decide what he wants to do
@@ -240,6 +253,65 @@ void CPU::start() {
 }
 
 void CPU::cycle() {
+  // For some reason, a sleep of 1 microsecond (?!) improves performance
+  // considerably, this may have something to do with other threads, mainly
+  // the drawing and rendering threads, not getting enough cpu time and a sleep
+  // at this point will yield control to them more often.
+  //
+  // Since this emulator isn't really performance focused, this is okay.
+  //
+  // In virtual time mode, no other threads depend on the CPU yielding and
+  // we run as fast as possible.
+  if (!this->bus->is_virtual_time())
+    std::this_thread::sleep_for(std::chrono::microseconds(1));
+
+  this->step();
+
+  // Let devices catch up if they scheduled an event
+  if (this->cycles >= *this->next_event)
+    this->bus->advance(this->cycles);
+}
+
+uint64_t CPU::run_for(uint64_t cycles) {
+  uint64_t start = this->cycles;
+  uint64_t end = start + cycles;
+  this->run_end = end;
+  Bus::current_core = this->core;
+  while (!this->shutdown && !this->illegal_opcode && this->cycles < end) {
+    // Run until either the budget is used up or a device event is due
+    while (!this->illegal_opcode && this->cycles < std::min(end, *this->next_event)) {
+      this->step();
+    }
+
+    if (this->cycles >= *this->next_event)
+      this->bus->advance(this->cycles);
+  }
+  this->run_end = kCycleNever;
+  return this->cycles - start;
+}
+
+bool CPU::run_until(uint16_t address, uint64_t cycles) {
+  uint64_t end = this->cycles + cycles;
+  this->run_end = end;
+  Bus::current_core = this->core;
+  bool reached = false;
+  while (!reached && !this->shutdown && !this->illegal_opcode && this->cycles < end) {
+    while (!this->illegal_opcode && this->cycles < std::min(end, *this->next_event)) {
+      this->step();
+      if (this->PC == address) {
+        reached = true;
+        break;
+      }
+    }
+
+    if (this->cycles >= *this->next_event)
+      this->bus->advance(this->cycles);
+  }
+  this->run_end = kCycleNever;
+  return reached;
+}
+
+void CPU::step() {
   // Check if there was an interrupt
   if (!this->I) {
     if (this->int_irq) {
@@ -254,24 +326,22 @@ void CPU::cycle() {
     this->handle_res();
   }
 
-  // For some reason, a sleep of 1 microsecond (?!) improves performance
-  // considerably, this may have something to do with other threads, mainly
-  // the drawing and rendering threads, not getting enough cpu time and a sleep
-  // at this point will yield control to them more often.
-  //
-  // Since this emulator isn't really performance focused, this is okay.
-  std::this_thread::sleep_for(std::chrono::microseconds(1));
   uint8_t opcode = this->bus->read_byte(this->PC++);
   Instruction instruction = this->dispatch_table[opcode];
   this->exec_instruction(instruction);
+  this->cycles += kOpcodeCycles[opcode];
+  this->instructions++;
 }
 
 void CPU::handle_irq() {
   this->int_irq = false;
+  this->cycles += kInterruptCycles;
   this->stack_push_word(this->PC);
   this->stack_push_byte(this->STATUS);
   this->I = true;
-  this->PC = this->bus->read_word(kVecIRQ);
+  uint16_t from = this->PC;
+  this->PC = this->bus->irq_vector(this->core);
+  this->record_edge(from, this->PC);
 
   //std::cout << std::hex;
   //std::cout << "racket1_pos" << ": " << reinterpret_cast<void*>(this->bus->read_byte(0x00)) << std::endl;
@@ -289,15 +359,20 @@ void CPU::handle_brk() {
   this->stack_push_word(this->PC);
   this->stack_push_byte(this->STATUS | kMaskBreak);
   this->I = true;
+  uint16_t from = this->PC;
   this->PC = this->bus->read_word(kVecBRK);
+  this->record_edge(from, this->PC);
 }
 
 void CPU::handle_nmi() {
   this->int_nmi = false;
+  this->cycles += kInterruptCycles;
   this->stack_push_word(this->PC);
   this->stack_push_byte(this->STATUS);
   this->I = true;
+  uint16_t from = this->PC;
   this->PC = this->bus->read_word(kVecNMI);
+  this->record_edge(from, this->PC);
 }
 
 void CPU::handle_res() {
@@ -311,6 +386,34 @@ void CPU::handle_res() {
   this->illegal_opcode = false;
 }
 
+void CPU::snapshot(SnapshotWriter& writer) {
+  writer.write_byte(this->A);
+  writer.write_byte(this->X);
+  writer.write_byte(this->Y);
+  writer.write_byte(this->SP);
+  writer.write_word(this->PC);
+  writer.write_byte(this->STATUS);
+  writer.write_quad(this->cycles);
+  writer.write_byte(this->illegal_opcode);
+  writer.write_byte(this->int_irq);
+  writer.write_byte(this->int_nmi);
+  writer.write_byte(this->int_res);
+}
+
+void CPU::restore(SnapshotReader& reader) {
+  this->A = reader.read_byte();
+  this->X = reader.read_byte();
+  this->Y = reader.read_byte();
+  this->SP = reader.read_byte();
+  this->PC = reader.read_word();
+  this->STATUS = reader.read_byte();
+  this->cycles = reader.read_quad();
+  this->illegal_opcode = reader.read_byte();
+  this->int_irq = reader.read_byte();
+  this->int_nmi = reader.read_byte();
+  this->int_res = reader.read_byte();
+}
+
 void CPU::dump_state(std::ostream& out) {
   out << std::hex;
 
@@ -470,22 +573,24 @@ void CPU::op_asl_acc(uint16_t) {
   this->A = operand;
 }
 
-void CPU::op_bcc(uint16_t src) {
-  if (!this->C) {
+void CPU::branch(uint16_t src, bool condition) {
+  uint16_t from = this->PC;
+  if (condition) {
     this->PC += this->bus->read_byte(src);
   }
+  this->record_edge(from, this->PC);
+}
+
+void CPU::op_bcc(uint16_t src) {
+  this->branch(src, !this->C);
 }
 
 void CPU::op_bcs(uint16_t src) {
-  if (this->C) {
-    this->PC += this->bus->read_byte(src);
-  }
+  this->branch(src, this->C);
 }
 
 void CPU::op_beq(uint16_t src) {
-  if (this->Z) {
-    this->PC += this->bus->read_byte(src);
-  }
+  this->branch(src, this->Z);
 }
 
 void CPU::op_bit(uint16_t src) {
@@ -497,21 +602,15 @@ void CPU::op_bit(uint16_t src) {
 }
 
 void CPU::op_bmi(uint16_t src) {
-  if (this->S) {
-    this->PC += this->bus->read_byte(src);
-  }
+  this->branch(src, this->S);
 }
 
 void CPU::op_bne(uint16_t src) {
-  if (!this->Z) {
-    this->PC += this->bus->read_byte(src);
-  }
+  this->branch(src, !this->Z);
 }
 
 void CPU::op_bpl(uint16_t src) {
-  if (!this->S) {
-    this->PC += this->bus->read_byte(src);
-  }
+  this->branch(src, !this->S);
 }
 
 void CPU::op_brk(uint16_t) {
@@ -520,15 +619,11 @@ void CPU::op_brk(uint16_t) {
 }
 
 void CPU::op_bvc(uint16_t src) {
-  if (!this->V) {
-    this->PC += this->bus->read_byte(src);
-  }
+  this->branch(src, !this->V);
 }
 
 void CPU::op_bvs(uint16_t src) {
-  if (this->V) {
-    this->PC += this->bus->read_byte(src);
-  }
+  this->branch(src, this->V);
 }
 
 void CPU::op_clc(uint16_t) {
@@ -625,11 +720,13 @@ void CPU::op_iny(uint16_t) {
 }
 
 void CPU::op_jmp(uint16_t src) {
+  this->record_edge(this->PC, src);
   this->PC = src;
 }
 
 void CPU::op_jsr(uint16_t src) {
   this->stack_push_word(this->PC - 1);
+  this->record_edge(this->PC, src);
   this->PC = src;
 }
 
@@ -757,12 +854,16 @@ void CPU::op_ror_acc(uint16_t) {
 }
 
 void CPU::op_rti(uint16_t) {
+  uint16_t from = this->PC;
   this->STATUS = this->stack_pop_byte() | kMaskConstant;
   this->PC = this->stack_pop_word();
+  this->record_edge(from, this->PC);
 }
 
 void CPU::op_rts(uint16_t) {
+  uint16_t from = this->PC;
   this->PC = this->stack_pop_word() + 1;
+  this->record_edge(from, this->PC);
 }
 
 void CPU::op_sbc(uint16_t src) {
@@ -844,6 +945,24 @@ void CPU::op_tya(uint16_t) {
 }
 
 void CPU::op_wai(uint16_t) {
+  // In virtual time mode, skip ahead to the next scheduled device event
+  // instead of waiting for it to happen. Only the primary core advances the devices.
+  if (this->bus->is_virtual_time()) {
+    while (this->core == 0 && !(this->int_irq || this->int_nmi || this->int_res) &&
+           this->bus->next_device_event != kCycleNever && this->bus->next_device_event <= this->run_end) {
+      this->cycles = std::max(this->cycles, this->bus->next_device_event);
+      this->bus->advance_devices(this->cycles);
+    }
+
+    // Inside of run_for(), nothing else can interrupt the CPU before the slice ends. The CPU idles
+    // until then and executes the WAI instruction again in the next slice.
+    if (!(this->int_irq || this->int_nmi || this->int_res) && this->run_end != kCycleNever) {
+      this->cycles = std::max(this->cycles, this->run_end);
+      this->PC--;
+      return;
+    }
+  }
+
   std::unique_lock<std::mutex> lk(this->mutex_int);
   this->cv_int.wait(lk, [&] {
     return this->int_irq || this->int_nmi || this->int_res;
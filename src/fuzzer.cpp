@@ -0,0 +1,213 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "fuzzer.h"
+#include "machine.h"
+
+namespace M6502 {
+
+// Values which tend to hit boundary conditions
+static constexpr uint8_t kFuzzInterestingValues[] = {0x00, 0x01, 0x7F, 0x80, 0xFE, 0xFF};
+
+// Buckets of hit counts, changes between buckets count as new coverage
+static uint8_t hit_bucket(uint8_t count) {
+  if (count <= 3)
+    return count == 0 ? 0 : 1 << (count - 1);
+  if (count <= 7)
+    return 0x08;
+  if (count <= 15)
+    return 0x10;
+  if (count <= 31)
+    return 0x20;
+  if (count <= 127)
+    return 0x40;
+  return 0x80;
+}
+
+Fuzzer::Fuzzer(Machine* machine, uint16_t exit_address) : machine(machine), exit_address(exit_address) {
+  std::memset(this->coverage, 0, sizeof(this->coverage));
+  std::memset(this->seen, 0, sizeof(this->seen));
+  this->machine->bus.save_golden();
+}
+
+void Fuzzer::add_seed(const std::vector<uint8_t>& input) {
+  this->corpus.push_back(input);
+}
+
+int Fuzzer::run(const std::vector<uint8_t>& input) {
+  Machine* machine = this->machine;
+  machine->bus.reset_to_golden();
+  std::memset(this->coverage, 0, sizeof(this->coverage));
+  machine->cpu.coverage = this->coverage;
+  this->executions++;
+
+  size_t ram_bytes = std::min(input.size(), this->ram_size);
+  for (size_t i = 0; i < ram_bytes; i++)
+    machine->bus.write_byte(this->ram_address + i, input[i]);
+
+  int outcome = kFuzzOk;
+  size_t position = ram_bytes;
+  for (;;) {
+    bool reached = machine->cpu.run_until(this->exit_address, this->cycle_budget);
+    if (machine->cpu.illegal_opcode) {
+      outcome = kFuzzIllegalOpcode;
+      break;
+    }
+    if (!reached) {
+      outcome = kFuzzRunaway;
+      break;
+    }
+
+    if (position + 2 > input.size())
+      break;
+    uint8_t type = input[position + 1] & 0x80 ? kIOEventKeyup : kIOEventKeydown;
+    machine->io.inject_key(type, input[position], input[position + 1] & 0x7F);
+    position += 2;
+  }
+
+  machine->cpu.coverage = nullptr;
+  return outcome;
+}
+
+void Fuzzer::fuzz(size_t iterations) {
+  if (this->corpus.empty())
+    this->corpus.emplace_back();
+
+  // Seeds contribute their coverage before they are mutated
+  if (this->edges == 0) {
+    for (const std::vector<uint8_t>& seed : this->corpus) {
+      int outcome = this->run(seed);
+      this->update_coverage();
+      if (outcome != kFuzzOk)
+        this->record_finding(outcome, seed);
+    }
+  }
+
+  for (size_t i = 0; i < iterations; i++) {
+    const std::vector<uint8_t>& parent = this->corpus[this->rng() % this->corpus.size()];
+    std::vector<uint8_t> input = this->mutate(parent);
+
+    int outcome = this->run(input);
+    bool interesting = this->update_coverage();
+    if (outcome != kFuzzOk) {
+      this->record_finding(outcome, input);
+    } else if (interesting) {
+      this->corpus.push_back(std::move(input));
+    }
+  }
+}
+
+bool Fuzzer::update_coverage() {
+  bool interesting = false;
+
+  // Most of the map is empty, so it is scanned 8 counters at a time
+  for (size_t word = 0; word < kCoverageMapSize; word += sizeof(uint64_t)) {
+    uint64_t counters;
+    std::memcpy(&counters, this->coverage + word, sizeof(counters));
+    if (counters == 0)
+      continue;
+
+    for (size_t i = word; i < word + sizeof(uint64_t); i++) {
+      if (this->coverage[i] == 0)
+        continue;
+
+      uint8_t bucket = hit_bucket(this->coverage[i]);
+      if (bucket & ~this->seen[i]) {
+        if (this->seen[i] == 0)
+          this->edges++;
+        this->seen[i] |= bucket;
+        interesting = true;
+      }
+    }
+  }
+  return interesting;
+}
+
+void Fuzzer::record_finding(int outcome, const std::vector<uint8_t>& input) {
+  // Findings are told apart by where the guest ended up
+  uint16_t address = this->machine->cpu.PC;
+  for (const FuzzFinding& finding : this->findings) {
+    if (finding.outcome == outcome && finding.address == address)
+      return;
+  }
+  this->findings.push_back({outcome, address, input});
+}
+
+std::vector<uint8_t> Fuzzer::mutate(const std::vector<uint8_t>& input) {
+  std::vector<uint8_t> result = input;
+  size_t mutations = 1 + this->rng() % 4;
+  for (size_t i = 0; i < mutations; i++) {
+    switch (this->rng() % 6) {
+      case 0: {
+        if (!result.empty())
+          result[this->rng() % result.size()] ^= 1 << (this->rng() % 8);
+        break;
+      }
+      case 1: {
+        if (!result.empty())
+          result[this->rng() % result.size()] = this->rng();
+        break;
+      }
+      case 2: {
+        if (!result.empty()) {
+          size_t count = sizeof(kFuzzInterestingValues);
+          result[this->rng() % result.size()] = kFuzzInterestingValues[this->rng() % count];
+        }
+        break;
+      }
+      case 3: {
+        if (result.size() < this->max_input_size)
+          result.insert(result.begin() + this->rng() % (result.size() + 1), static_cast<uint8_t>(this->rng()));
+        break;
+      }
+      case 4: {
+        if (!result.empty())
+          result.erase(result.begin() + this->rng() % result.size());
+        break;
+      }
+      case 5: {
+        // Splice in a piece of another corpus entry
+        const std::vector<uint8_t>& other = this->corpus[this->rng() % this->corpus.size()];
+        if (other.empty())
+          break;
+        size_t start = this->rng() % other.size();
+        size_t length = 1 + this->rng() % (other.size() - start);
+        size_t offset = this->rng() % (result.size() + 1);
+        result.insert(result.begin() + offset, other.begin() + start, other.begin() + start + length);
+        if (result.size() > this->max_input_size)
+          result.resize(this->max_input_size);
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+}  // namespace M6502
@@ -0,0 +1,91 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "inputlog.h"
+#include "snapshot.h"
+
+namespace M6502 {
+
+void InputLog::record(
+    uint64_t cycle, uint32_t frame, uint8_t kind, uint8_t type, uint8_t payload1, uint8_t payload2) {
+  std::unique_lock<std::mutex> lk(this->mutex);
+  this->records.push_back({cycle, kind, type, payload1, payload2, frame});
+}
+
+std::vector<uint8_t> InputLog::serialize() {
+  std::unique_lock<std::mutex> lk(this->mutex);
+  SnapshotWriter writer;
+  writer.begin_section(kSnapshotSectionInput);
+
+  writer.write_quad(this->end_cycle);
+  writer.write_long(this->snapshot.size());
+  writer.write_block(this->snapshot.data(), this->snapshot.size());
+
+  writer.write_long(this->records.size());
+  for (const InputRecord& record : this->records) {
+    writer.write_quad(record.cycle);
+    writer.write_byte(record.kind);
+    writer.write_byte(record.type);
+    writer.write_byte(record.payload1);
+    writer.write_byte(record.payload2);
+    writer.write_long(record.frame);
+  }
+
+  writer.end_section();
+  return std::move(writer.get_data());
+}
+
+bool InputLog::deserialize(const std::vector<uint8_t>& data) {
+  std::unique_lock<std::mutex> lk(this->mutex);
+  SnapshotReader reader(data.data(), data.size());
+  if (!reader.read_header() || !reader.begin_section(kSnapshotSectionInput))
+    return false;
+
+  this->end_cycle = reader.read_quad();
+  uint32_t snapshot_size = reader.read_long();
+  if (snapshot_size > data.size() * kSnapshotMaxRun)
+    return false;
+  this->snapshot.resize(snapshot_size);
+  reader.read_block(this->snapshot.data(), snapshot_size);
+
+  uint32_t count = reader.read_long();
+  this->records.clear();
+  for (uint32_t i = 0; i < count && !reader.failed(); i++) {
+    InputRecord record;
+    record.cycle = reader.read_quad();
+    record.kind = reader.read_byte();
+    record.type = reader.read_byte();
+    record.payload1 = reader.read_byte();
+    record.payload2 = reader.read_byte();
+    record.frame = reader.read_long();
+    this->records.push_back(record);
+  }
+
+  return reader.end_section();
+}
+
+}  // namespace M6502
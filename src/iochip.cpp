@@ -25,6 +25,7 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <cstring>
@@ -41,19 +42,24 @@
 #endif
 #endif
 
+#include "audiosynth.h"
 #include "bus.h"
+#include "charset.h"
+#include "cpu.h"
 #include "iochip.h"
+#include "snapshot.h"
 
 namespace M6502 {
 
 IOChip::IOChip(uint16_t maddr) : BusDevice(maddr) {
-  std::memset(this->vram, 0, kIOVRAMSize);
+  std::memset(this->memory, 0, sizeof(this->memory));
   this->control = kIOControlKeyboardDisabled | kIOControlMouseDisabled;
 
   this->background_color = ColorValue(0x00);
   this->foreground_color = ColorValue(0xFF);
 
   this->event_type = kIOEventUnspecified;
+  this->memory[kIOInterruptMask] = 0xFF;
   this->mouse.x = 0x00;
   this->mouse.y = 0x00;
 
@@ -64,7 +70,33 @@ IOChip::IOChip(uint16_t maddr) : BusDevice(maddr) {
   this->audio_channel2 = 0x00;
   this->audio_channel3 = 0x00;
 
+  std::memset(this->front_vram, 0, kIOVRAMSize);
+  std::memset(this->vram_shadow, 0, kIOVRAMSize);
+  std::memset(this->front_vram_shadow, 0, kIOVRAMSize);
+  this->vram_sequence = 0;
+  this->flip_pending = false;
+
+  this->timer_slots[kIOTimerSlotClock1].address = kIOClock1;
+  this->timer_slots[kIOTimerSlotClock1].event_type = kIOEventClock1;
+  this->timer_slots[kIOTimerSlotClock2].address = kIOClock2;
+  this->timer_slots[kIOTimerSlotClock2].event_type = kIOEventClock2;
+  this->timer_slots[kIOTimerSlotTimer1].address = kIOTimer1Lo;
+  this->timer_slots[kIOTimerSlotTimer1].event_type = kIOEventTimer1;
+  this->timer_slots[kIOTimerSlotTimer2].address = kIOTimer2Lo;
+  this->timer_slots[kIOTimerSlotTimer2].event_type = kIOEventTimer2;
+  this->timer_slots[kIOTimerSlotCounter1].address = kIOCounter1;
+  this->timer_slots[kIOTimerSlotCounter1].event_type = kIOEventCounter1;
+  this->timer_slots[kIOTimerSlotCounter2].address = kIOCounter2;
+  this->timer_slots[kIOTimerSlotCounter2].event_type = kIOEventCounter2;
+
   this->shutdown = false;
+  this->window_requested = false;
+
+  for (int i = 0; i < 256; i++) {
+    this->color_table[i] = ColorValue(i).get_sfml_color();
+    this->palette[i] = this->color_table[i];
+  }
+  this->get_palette_data(this->palette_shadow);
 }
 
 IOChip::~IOChip() {
@@ -77,14 +109,17 @@ void IOChip::start() {
   XInitThreads();
 #endif
 
-  this->load_audio_buffers();
-
   this->shutdown = false;
 
-  // Start the audio, clock and rendering threads
-  this->worker_threads.push_back(std::thread(&IOChip::thread_clock, this, kIOClock1));
-  this->worker_threads.push_back(std::thread(&IOChip::thread_clock, this, kIOClock2));
-  this->drawing_thread = std::thread(&IOChip::thread_drawing, this);
+  // Wait until the guest needs a window
+  {
+    std::unique_lock<std::mutex> lk(this->window_mutex);
+    this->condition_window.wait(lk, [&]() {
+      return this->window_requested || this->halted || this->shutdown;
+    });
+  }
+  if (this->shutdown || !this->window_requested)
+    return;
 
   // Create the window and the thread which handles all the drawing
   //
@@ -96,102 +131,230 @@ void IOChip::start() {
   //
   // See https://www.sfml-dev.org/tutorials/2.0/graphics-draw.php for a simple
   // tutorial on how drawing from other threads works.
-  sf::VideoMode video_mode(kIOVideoModeWidth, kIOVideoModeHeight);
-  this->main_window = new sf::RenderWindow(video_mode, kIOVideoTitle, sf::Style::Titlebar);
+  this->open_window();
   this->render_thread = std::thread(&IOChip::thread_render, this);
 
   sf::Event event;
   while (!this->shutdown && this->main_window->isOpen()) {
     while (this->main_window->pollEvent(event)) {
-      switch (event.type) {
-        case sf::Event::Closed: {
-          this->main_window->close();
-          this->shutdown = true;
-          break;
-        }
-        case sf::Event::KeyPressed: {
-          uint8_t modifier_byte = 0x00;
-          if (event.key.alt)
-            modifier_byte |= kIOKeyboardModifierAlt;
-          if (event.key.control)
-            modifier_byte |= kIOKeyboardModifierControl;
-          if (event.key.shift)
-            modifier_byte |= kIOKeyboardModifierShift;
-          if (event.key.system)
-            modifier_byte |= kIOKeyboardModifierSystem;
-          this->memory[kIOEventType] = kIOEventKeydown;
-          this->memory[kIOKeyboardKeycode] = event.key.code;
-          this->memory[kIOKeyboardModifiers] = modifier_byte;
-          this->bus->int_irq();
-          break;
-        }
-        default: {
-          // TODO: Handle events
-          break;
-        }
-      }
+      this->handle_event(event);
+    }
+  }
+}
+
+void IOChip::start_single_threaded(bool headless) {
+  // Timers are driven by the CPU, so no scheduler thread is needed
+  this->bus->enable_virtual_time();
+  this->single_threaded = true;
+  this->headless = headless;
+  this->shutdown = false;
+}
+
+void IOChip::cpu_halted() {
+  std::unique_lock<std::mutex> lk(this->window_mutex);
+  this->halted = true;
+  this->condition_window.notify_one();
+}
+
+bool IOChip::is_display_address(uint16_t address) {
+  if (address < kIOVRAMSize)
+    return true;
+
+  switch (address) {
+    case kIOControl:
+    case kIOTextModeBackgroundColor:
+    case kIOTextModeForegroundColor:
+    case kIODrawMethod:
+    case kIOSpriteTable:
+    case kIOTileSet:
+    case kIOPaletteIndex:
+    case kIOPaletteData:
+    case kIOVideoSync: return true;
+    default: return false;
+  }
+}
+
+void IOChip::request_window() {
+  std::unique_lock<std::mutex> lk(this->window_mutex);
+  this->window_requested = true;
+  this->condition_window.notify_one();
+}
+
+void IOChip::open_window() {
+  sf::VideoMode video_mode(kIOVideoModeWidth, kIOVideoModeHeight);
+  this->main_window = new sf::RenderWindow(video_mode, kIOVideoTitle, sf::Style::Titlebar);
+}
+
+void IOChip::run_frame() {
+  if (this->window_requested && this->main_window == nullptr && !this->headless)
+    this->open_window();
+
+  if (this->main_window != nullptr) {
+    sf::Event event;
+    while (this->main_window->pollEvent(event)) {
+      this->handle_event(event);
     }
   }
+
+  // All inputs of this frame arrived, the VBLANK event comes after them
+  this->bus->end_frame();
+
+  if (this->main_window != nullptr && !this->shutdown && this->main_window->isOpen() &&
+      !(this->control & kIOControlVisibility)) {
+    this->render_frame();
+    return;
+  }
+
+  // Without a visible window, flips and VBLANK interrupts still happen once per frame
+  this->commit_flip();
+  this->raise_vblank();
+}
+
+void IOChip::handle_event(sf::Event& event) {
+  switch (event.type) {
+    case sf::Event::Closed: {
+      this->main_window->close();
+      this->shutdown = true;
+      break;
+    }
+    case sf::Event::KeyPressed:
+    case sf::Event::KeyReleased: {
+      if (this->keyboard_disabled)
+        break;
+
+      uint8_t modifier_byte = 0x00;
+      if (event.key.alt)
+        modifier_byte |= kIOKeyboardModifierAlt;
+      if (event.key.control)
+        modifier_byte |= kIOKeyboardModifierControl;
+      if (event.key.shift)
+        modifier_byte |= kIOKeyboardModifierShift;
+      if (event.key.system)
+        modifier_byte |= kIOKeyboardModifierSystem;
+      uint8_t type = event.type == sf::Event::KeyPressed ? kIOEventKeydown : kIOEventKeyup;
+      this->raise_input_event(type, event.key.code, modifier_byte);
+      break;
+    }
+    case sf::Event::MouseMoved: {
+      if (this->mouse_disabled)
+        break;
+      this->raise_mouse_event(kIOEventMousemove, event.mouseMove.x, event.mouseMove.y);
+      break;
+    }
+    case sf::Event::MouseButtonPressed:
+    case sf::Event::MouseButtonReleased: {
+      if (this->mouse_disabled || event.mouseButton.button != sf::Mouse::Left)
+        break;
+      uint8_t type = event.type == sf::Event::MouseButtonPressed ? kIOEventMousedown : kIOEventMouseup;
+      this->raise_mouse_event(type, event.mouseButton.x, event.mouseButton.y);
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+}
+
+void IOChip::inject_key(uint8_t type, uint8_t keycode, uint8_t modifiers) {
+  if (this->keyboard_disabled)
+    return;
+  this->raise_input_event(type, keycode, modifiers);
+}
+
+void IOChip::inject_event(uint8_t type, uint8_t payload1, uint8_t payload2) {
+  if (type >= kIOEventMousemove && type <= kIOEventMouseup) {
+    this->mouse_pixel_x = payload1;
+    this->mouse_pixel_y = payload2;
+  }
+  this->raise_event(type, payload1, payload2);
 }
 
 void IOChip::stop() {
   this->shutdown = true;
-  this->render_thread.join();
-  this->condition_draw.notify_one();
-  this->drawing_thread.join();
-  for (auto& t : this->worker_threads)
-    t.join();
+
+  // Threads are started lazily and might never have been started. Taking their
+  // locks makes sure no thread is started after we checked for it.
+  if (this->render_thread.joinable())
+    this->render_thread.join();
+  {
+    std::unique_lock<std::shared_mutex> lk(this->draw_pipeline_mutex);
+    this->condition_draw.notify_one();
+  }
+  if (this->drawing_thread.joinable())
+    this->drawing_thread.join();
+  {
+    std::unique_lock<std::mutex> lk(this->scheduler_mutex);
+    this->condition_scheduler.notify_one();
+  }
+  if (this->scheduler_thread.joinable())
+    this->scheduler_thread.join();
 
   delete this->main_window;
 
-  this->worker_threads.clear();
   this->main_window = nullptr;
+
+  std::unique_lock<std::mutex> lk(this->audio_mutex);
+  this->stop_audio();
 }
 
-void IOChip::load_audio_buffers() {
-  sf::Int16 raw[kIOAudioSamples];
-  double x;
+void IOChip::start_audio() {
+  this->audio_synth = new AudioSynth();
+  this->audio_stream = new AudioStream(this->audio_synth);
+  this->audio_origin = this->now_ticks();
+  this->audio_stream->play();
 
-  // Generate sine wave data
-  x = 0;
-  for (uint32_t i = 0; i < kIOAudioSamples; i++) {
-    raw[i] = kIOAudioAmplitude * sin(x * kIOAudioTwoPi);
-    x += kIOAudioSampleIncrement;
-  }
-  this->audio_buffer_sine.loadFromSamples(raw, kIOAudioSamples, 1, kIOAudioSampleRate);
-
-  // Generate square wave data
-  x = 0;
-  for (uint32_t i = 0; i < kIOAudioSamples; i++) {
-    raw[i] = kIOAudioAmplitude * (sin(x * kIOAudioTwoPi) >= 0.0 ? 1 : 0.5);
-    x += kIOAudioSampleIncrement;
-  }
-  this->audio_buffer_square.loadFromSamples(raw, kIOAudioSamples, 1, kIOAudioSampleRate);
+  this->audio_loaded = true;
+}
 
-  // TODO: Generate saw and triangle wave data
-  //       Right now we just load these buffers with square wave data
-  this->audio_buffer_saw.loadFromSamples(raw, kIOAudioSamples, 1, kIOAudioSampleRate);
-  this->audio_buffer_triangle.loadFromSamples(raw, kIOAudioSamples, 1, kIOAudioSampleRate);
+void IOChip::stop_audio() {
+  if (!this->audio_loaded)
+    return;
 
-  this->audio_sound1.setLoop(true);
-  this->audio_sound2.setLoop(true);
-  this->audio_sound3.setLoop(true);
+  if (this->audio_stream != nullptr)
+    this->audio_stream->stop();
+  delete this->audio_stream;
+  delete this->audio_synth;
+  this->audio_stream = nullptr;
+  this->audio_synth = nullptr;
+  this->audio_loaded = false;
+  this->audio_offline = false;
 }
 
-void IOChip::thread_clock(uint16_t source) {
-  uint8_t clock_source = 0;
-  while (!this->shutdown) {
-    clock_source = this->memory[source];
-    if (!clock_source) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(500));
-      continue;
-    }
-    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<unsigned int>(5) * clock_source));
-    this->memory[kIOEventType] = source == kIOClock1 ? kIOEventClock1 : kIOEventClock2;
-    this->bus->int_irq();
+void IOChip::start_offline_audio() {
+  std::unique_lock<std::mutex> lk(this->audio_mutex);
+  if (this->audio_offline)
+    return;
+
+  // Audio already streaming to the device is replaced, the channels keep their settings
+  bool streaming = this->audio_loaded;
+  this->stop_audio();
+  this->bus->enable_virtual_time();
+
+  this->audio_synth = new AudioSynth();
+  this->audio_origin = this->now_ticks();
+  this->audio_offline = true;
+  this->audio_loaded = true;
+  if (streaming) {
+    for (size_t i = 0; i < kIOAudioChannelCount; i++)
+      this->audio_synth->write(0, i, this->memory[kIOAudioChannel1 + i]);
   }
 }
 
+void IOChip::render_offline_audio(std::vector<sf::Int16>& samples) {
+  std::unique_lock<std::mutex> lk(this->audio_mutex);
+  if (!this->audio_offline)
+    return;
+
+  uint64_t target = this->audio_target_sample();
+  if (target <= this->audio_synth->position())
+    return;
+
+  uint64_t count = target - this->audio_synth->position();
+  size_t offset = samples.size();
+  samples.resize(offset + count);
+  this->audio_synth->render(samples.data() + offset, count);
+}
+
 void IOChip::thread_drawing() {
   while (!this->shutdown) {
     std::unique_lock<std::mutex> l(this->draw_mutex);
@@ -212,81 +375,481 @@ void IOChip::thread_drawing() {
       this->draw_pipeline.pop();
     }
 
-    switch (instruction.method_code) {
-      case kIODrawRectangle: {
-        this->draw_rectangle(instruction.arg1, instruction.arg2, instruction.arg3, instruction.arg4);
-        break;
-      }
-      case kIODrawSquare: {
-        this->draw_square(instruction.arg1, instruction.arg2, instruction.arg3);
-        break;
-      }
-      case kIODrawDot: {
-        this->draw_dot(instruction.arg1, instruction.arg2);
-        break;
-      }
-      case kIODrawLine: {
-        this->draw_line(instruction.arg1, instruction.arg2, instruction.arg3, instruction.arg4);
-        break;
-      }
-      case kIOBrushSetBody: {
-        this->brush_body_color = instruction.arg1;
-        break;
-      }
-      case kIOBrushSetOutline: {
-        this->brush_outline_color = instruction.arg1;
-        break;
-      }
+    this->execute_draw_instruction(instruction);
+  }
+}
+
+void IOChip::execute_draw_instruction(const DrawInstruction& instruction) {
+  // Readers of VRAM retry their snapshot if the sequence number is odd
+  // or changed while they were copying
+  this->vram_sequence.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  switch (instruction.method_code) {
+    case kIODrawRectangle: {
+      this->draw_rectangle(instruction.arg1, instruction.arg2, instruction.arg3, instruction.arg4);
+      break;
+    }
+    case kIODrawSquare: {
+      this->draw_square(instruction.arg1, instruction.arg2, instruction.arg3);
+      break;
+    }
+    case kIODrawDot: {
+      this->draw_dot(instruction.arg1, instruction.arg2);
+      break;
+    }
+    case kIODrawLine: {
+      this->draw_line(instruction.arg1, instruction.arg2, instruction.arg3, instruction.arg4);
+      break;
+    }
+    case kIODrawClear: {
+      this->draw_clear();
+      break;
+    }
+    case kIODrawFill: {
+      this->draw_fill(instruction.arg1, instruction.arg2, instruction.arg3, instruction.arg4);
+      break;
+    }
+    case kIODrawCopy: {
+      this->draw_copy(instruction.arg1, instruction.arg2, instruction.arg3, instruction.arg4);
+      break;
+    }
+    case kIODrawBlit: {
+      this->draw_blit(instruction.arg1, instruction.arg2, instruction.arg3, instruction.arg4);
+      break;
+    }
+    case kIODrawScroll: {
+      this->draw_scroll(instruction.arg1, instruction.arg2);
+      break;
+    }
+    case kIOBrushSetBody: {
+      this->brush_body_color = instruction.arg1;
+      break;
+    }
+    case kIOBrushSetOutline: {
+      this->brush_outline_color = instruction.arg1;
+      break;
+    }
+    case kIOBrushSetOrigin: {
+      this->brush_origin_x = instruction.arg1;
+      this->brush_origin_y = instruction.arg2;
+      break;
+    }
+    case kIOBrushSetSource: {
+      this->brush_source = instruction.arg1 | (instruction.arg2 << 8);
+      this->brush_stride = instruction.arg3;
+      break;
+    }
+    case kIOBrushSetKey: {
+      this->brush_key = instruction.arg1;
+      this->brush_key_enabled = instruction.arg2;
+      break;
     }
   }
+
+  std::fill(this->vram_dirty, this->vram_dirty + kIOVRAMPageCount, true);
+  std::fill(this->vram_golden_dirty, this->vram_golden_dirty + kIOVRAMPageCount, true);
+  this->vram_sequence.fetch_add(1, std::memory_order_release);
 }
 
 void IOChip::thread_render() {
-  while (!this->shutdown && this->main_window->isOpen()) {
-    // Check the control bytes for the configuration of the display
-    bool portrait_mode = this->control & kIOControlOrientation;
-    bool window_hidden = this->control & kIOControlVisibility;
-    // bool text_mode = this->control & kIOControlMode;
+  // Frames are paced against absolute deadlines, so the VBLANK interrupt
+  // doesn't drift by the time it takes to draw a frame
+  auto next_frame = std::chrono::steady_clock::now();
 
+  while (!this->shutdown && this->main_window->isOpen()) {
     // If the screen is hidden we sleep for some time until the window
     // is visible again.
     //
     // TODO: Could this be made more efficient using a lock?
-    if (window_hidden) {
+    if (this->control & kIOControlVisibility) {
       std::this_thread::sleep_for(std::chrono::seconds(1));
+      next_frame = std::chrono::steady_clock::now();
       continue;
     }
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(16));
+    next_frame += std::chrono::milliseconds(16);
+    std::this_thread::sleep_until(next_frame);
+
+    this->render_frame();
+  }
+}
+
+void IOChip::render_frame() {
+  // Check the control bytes for the configuration of the display
+  bool portrait_mode = this->control & kIOControlOrientation;
+  bool text_mode = this->control & kIOControlMode;
+
+  // These are the dimensions of the window we are drawing to
+  // and of the brush that is used to paint the pixels.
+  uint32_t screen_width = portrait_mode ? kIOVideoHeight : kIOVideoWidth;
+  uint32_t screen_height = portrait_mode ? kIOVideoWidth : kIOVideoHeight;
+  uint32_t pixels_row = portrait_mode ? kIOVideoScaleHeight : kIOVideoScaleWidth;
+  uint32_t pixels_column = portrait_mode ? kIOVideoScaleWidth : kIOVideoScaleHeight;
+
+  // Take a consistent snapshot of the displayed buffer
+  //
+  // Requested page flips are committed at this frame boundary
+  this->commit_flip();
+  if (this->memory[kIOVideoSync] & kIOVideoSyncDoubleBuffer) {
+    std::memcpy(this->frame, this->front_vram, kIOVRAMSize);
+  } else {
+    this->snapshot_vram(this->frame);
+  }
+
+  // The CPU thread may reprogram the palette while the frame is rendered
+  if (this->control & kIOControlPalette) {
+    std::unique_lock<std::mutex> lk(this->palette_mutex);
+    std::copy(this->palette, this->palette + 256, this->frame_palette);
+  }
+
+  if (text_mode) {
+    this->render_text_mode(screen_width, screen_height, pixels_row, pixels_column);
+  } else {
+    this->render_graphics_mode(screen_width, screen_height, pixels_row, pixels_column);
+  }
+
+  this->main_window->display();
+  this->raise_vblank();
+}
+
+void IOChip::commit_flip() {
+  if ((this->memory[kIOVideoSync] & kIOVideoSyncDoubleBuffer) && this->flip_pending) {
+    this->snapshot_vram(this->front_vram);
+    std::fill(this->front_vram_dirty, this->front_vram_dirty + kIOVRAMPageCount, true);
+    std::fill(this->front_vram_golden_dirty, this->front_vram_golden_dirty + kIOVRAMPageCount, true);
+    this->flip_pending = false;
+  }
+}
+
+void IOChip::raise_vblank() {
+  if (this->memory[kIOVideoSync] & kIOVideoSyncVBlank) {
+    this->raise_event(kIOEventVBlank);
+  }
+}
+
+void IOChip::raise_mouse_event(uint8_t type, int x, int y) {
+  bool portrait_mode = this->control & kIOControlOrientation;
+  int screen_width = portrait_mode ? kIOVideoHeight : kIOVideoWidth;
+  int screen_height = portrait_mode ? kIOVideoWidth : kIOVideoHeight;
+  int pixels_row = portrait_mode ? kIOVideoScaleHeight : kIOVideoScaleWidth;
+  int pixels_column = portrait_mode ? kIOVideoScaleWidth : kIOVideoScaleHeight;
+
+  uint8_t pixel_x = std::clamp(x / pixels_row, 0, screen_width - 1);
+  uint8_t pixel_y = std::clamp(y / pixels_column, 0, screen_height - 1);
+
+  // Movement within a pixel is invisible to the guest
+  if (type == kIOEventMousemove && pixel_x == this->mouse_pixel_x && pixel_y == this->mouse_pixel_y)
+    return;
+
+  this->raise_input_event(type, pixel_x, pixel_y);
+}
+
+void IOChip::raise_input_event(uint8_t type, uint8_t payload1, uint8_t payload2) {
+  // The bus records the event, or drops it while replaying a log
+  if (!this->bus->accept_input(kInputEvent, type, payload1, payload2))
+    return;
+  this->inject_event(type, payload1, payload2);
+}
+
+void IOChip::raise_event(uint8_t type, uint8_t payload1, uint8_t payload2) {
+  uint8_t source = this->interrupt_source(type);
+  if (!(this->memory[kIOInterruptMask] & source))
+    return;
+
+  {
+    std::unique_lock<std::mutex> lk(this->event_mutex);
+
+    if (!(this->control & kIOControlEventQueue)) {
+      // Only keyboard and mouse events overwrite the payload of the previous event
+      this->memory[kIOEventType] = type;
+      if (type <= kIOEventMouseup) {
+        this->memory[kIOEventType + 1] = payload1;
+        this->memory[kIOEventType + 2] = payload2;
+      }
+    } else {
+      // A mouse move which hasn't been presented yet is updated instead of queueing another one
+      if (type == kIOEventMousemove && this->event_queue_size > 1) {
+        IOEvent& last =
+            this->event_queue[(this->event_queue_head + this->event_queue_size - 1) % kIOEventQueueSize];
+        if (last.type == kIOEventMousemove) {
+          last.payload1 = payload1;
+          last.payload2 = payload2;
+          return;
+        }
+      }
+
+      if (this->event_queue_size == kIOEventQueueSize) {
+        this->event_queue_overflow = true;
+        return;
+      }
+
+      // High priority events overtake all pending low priority events, but never the presented one
+      bool high_priority = this->memory[kIOInterruptPriority] & source;
+      size_t position = this->event_queue_size;
+      if (high_priority && position > 0) {
+        position = 1;
+        while (position < this->event_queue_size &&
+               this->event_queue[(this->event_queue_head + position) % kIOEventQueueSize].high_priority) {
+          position++;
+        }
+        for (size_t i = this->event_queue_size; i > position; i--) {
+          this->event_queue[(this->event_queue_head + i) % kIOEventQueueSize] =
+              this->event_queue[(this->event_queue_head + i - 1) % kIOEventQueueSize];
+        }
+      }
+      this->event_queue[(this->event_queue_head + position) % kIOEventQueueSize] = {type, payload1, payload2,
+                                                                                    high_priority};
+      this->event_queue_size++;
+
+      // Events behind the presented one wait for their acknowledgement
+      if (this->event_queue_size > 1)
+        return;
+      this->present_event();
+    }
+
+    this->irq_pending = true;
+  }
+
+  this->bus->int_irq();
+}
+
+void IOChip::acknowledge_event() {
+  {
+    std::unique_lock<std::mutex> lk(this->event_mutex);
+    if (this->event_queue_size == 0)
+      return;
+
+    this->event_queue_head = (this->event_queue_head + 1) % kIOEventQueueSize;
+    this->event_queue_size--;
+    if (this->event_queue_size == 0) {
+      this->event_queue_overflow = false;
+      this->irq_pending = false;
+      return;
+    }
+
+    this->present_event();
+    this->irq_pending = true;
+  }
+
+  // Keep interrupting the CPU while there are pending events
+  this->bus->int_irq();
+}
+
+uint8_t IOChip::interrupt_source(uint8_t type) {
+  switch (type) {
+    case kIOEventKeydown:
+    case kIOEventKeyup: return kIOInterruptKeyboard;
+    case kIOEventMousemove:
+    case kIOEventMousedown:
+    case kIOEventMouseup: return kIOInterruptMouse;
+    case kIOEventClock1: return kIOInterruptClock1;
+    case kIOEventClock2: return kIOInterruptClock2;
+    case kIOEventTimer1:
+    case kIOEventTimer2: return kIOInterruptTimer;
+    case kIOEventCounter1:
+    case kIOEventCounter2: return kIOInterruptCounter;
+    case kIOEventVBlank: return kIOInterruptVBlank;
+    default: return 0x00;
+  }
+}
+
+uint16_t IOChip::interrupt_vector() {
+  // Servicing the IRQ clears it, the chip doesn't claim the next one unless it raised that as well
+  uint8_t type;
+  bool pending;
+  {
+    std::unique_lock<std::mutex> lk(this->event_mutex);
+    type = this->memory[kIOEventType];
+    pending = this->irq_pending;
+    this->irq_pending = false;
+  }
+
+  uint8_t table_page = this->memory[kIOInterruptVectors];
+  if (table_page == 0 || !pending || type >= kIOInterruptVectorCount)
+    return 0;
+
+  return this->bus->read_word((table_page << 8) + type * 2);
+}
+
+void IOChip::present_event() {
+  const IOEvent& event = this->event_queue[this->event_queue_head];
+  this->memory[kIOEventType] = event.type;
+  this->memory[kIOEventType + 1] = event.payload1;
+  this->memory[kIOEventType + 2] = event.payload2;
+}
+
+void IOChip::snapshot_vram(uint8_t* target) {
+  for (;;) {
+    uint32_t sequence = this->vram_sequence.load(std::memory_order_acquire);
+
+    // A draw instruction is currently being executed
+    if (sequence & 0x01) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    std::memcpy(target, this->vram, kIOVRAMSize);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (this->vram_sequence.load(std::memory_order_relaxed) == sequence)
+      return;
+  }
+}
+
+void IOChip::render_graphics_mode(uint32_t screen_width,
+                                  uint32_t screen_height,
+                                  uint32_t pixels_row,
+                                  uint32_t pixels_column) {
+  // The texture has to be recreated if the orientation of the screen changed
+  if (this->frame_width != screen_width || this->frame_height != screen_height) {
+    this->frame_texture.create(screen_width, screen_height);
+    this->frame_sprite.setTexture(this->frame_texture, true);
+    this->frame_sprite.setScale(pixels_row, pixels_column);
+    this->frame_width = screen_width;
+    this->frame_height = screen_height;
+  }
+
+  // Composite the sprite layer over the snapshot of VRAM
+  this->render_sprites(this->frame, screen_width, screen_height);
+
+  // Expand the frame into RGBA and draw it as a single texture
+  const sf::Color* colors = this->active_colors();
+  for (size_t i = 0; i < kIOVRAMSize; i++) {
+    const sf::Color& color = colors[this->frame[i]];
+    this->frame_pixels[i * 4] = color.r;
+    this->frame_pixels[i * 4 + 1] = color.g;
+    this->frame_pixels[i * 4 + 2] = color.b;
+    this->frame_pixels[i * 4 + 3] = color.a;
+  }
+  this->frame_texture.update(this->frame_pixels);
+
+  this->main_window->draw(this->frame_sprite);
+}
+
+void IOChip::render_text_mode(uint32_t screen_width,
+                              uint32_t screen_height,
+                              uint32_t pixels_row,
+                              uint32_t pixels_column) {
+  this->update_tile_atlas();
+
+  // The cell positions only change if the orientation of the screen changed
+  if (this->tile_vertices_width != screen_width || this->tile_vertices_height != screen_height) {
+    this->tile_vertices.setPrimitiveType(sf::Quads);
+    this->tile_vertices.resize(kIOVRAMSize * 4);
+    for (uint32_t y = 0; y < screen_height; y++) {
+      for (uint32_t x = 0; x < screen_width; x++) {
+        sf::Vertex* quad = &this->tile_vertices[(x + y * screen_width) * 4];
+        float left = x * pixels_row;
+        float top = y * pixels_column;
+        quad[0].position = sf::Vector2f(left, top);
+        quad[1].position = sf::Vector2f(left + pixels_row, top);
+        quad[2].position = sf::Vector2f(left + pixels_row, top + pixels_column);
+        quad[3].position = sf::Vector2f(left, top + pixels_column);
+      }
+    }
+    this->tile_vertices_width = screen_width;
+    this->tile_vertices_height = screen_height;
+  }
+
+  // Point every cell at its tile in the atlas
+  //
+  // Characters with bit 7 set map to the inverted copy of the tile, which swaps
+  // the background and foreground colors.
+  const sf::Color* colors = this->active_colors();
+  sf::Color foreground = colors[this->foreground_color.value];
+  sf::Color background = colors[this->background_color.value];
+  for (size_t i = 0; i < kIOVRAMSize; i++) {
+    uint8_t tile = this->frame[i];
+    float u = (tile % 16) * kIOTileSize;
+    float v = (tile / 16) * kIOTileSize;
+    sf::Vertex* quad = &this->tile_vertices[i * 4];
+    quad[0].texCoords = sf::Vector2f(u, v);
+    quad[1].texCoords = sf::Vector2f(u + kIOTileSize, v);
+    quad[2].texCoords = sf::Vector2f(u + kIOTileSize, v + kIOTileSize);
+    quad[3].texCoords = sf::Vector2f(u, v + kIOTileSize);
+    quad[0].color = quad[1].color = quad[2].color = quad[3].color = foreground;
+  }
 
-    // These are the dimensions of the window we are drawing to
-    // and of the brush that is used to paint the pixels.
-    uint32_t screen_width = portrait_mode ? kIOVideoHeight : kIOVideoWidth;
-    uint32_t screen_height = portrait_mode ? kIOVideoWidth : kIOVideoHeight;
-    uint32_t pixels_row = portrait_mode ? kIOVideoScaleHeight : kIOVideoScaleWidth;
-    uint32_t pixels_column = portrait_mode ? kIOVideoScaleWidth : kIOVideoScaleHeight;
+  this->main_window->clear(background);
+  this->main_window->draw(this->tile_vertices, sf::RenderStates(&this->tile_atlas));
+}
 
-    // Iterate over every pixel in VRAM and draw it to the screen
-    sf::RectangleShape brush(sf::Vector2f(pixels_row, pixels_column));
-    for (uint8_t y = 0; y < screen_height; y++) {
-      for (uint8_t x = 0; x < screen_width; x++) {
-        // Fetch the color from VRAM
-        uint8_t vram_raw = this->vram[x + y * screen_width];
-        ColorValue vram_color(vram_raw);
+void IOChip::update_tile_atlas() {
+  uint8_t tiles[kIOTileSetSize];
+  uint8_t tile_set_page = this->memory[kIOTileSet];
+  if (tile_set_page == 0) {
+    std::memcpy(tiles, kIOCharset, kIOTileSetSize);
+  } else {
+    this->bus->read_block(tile_set_page << 8, tiles, kIOTileSetSize);
+  }
 
-        // Paint the corresponding section of the window
-        brush.setFillColor(vram_color.get_sfml_color());
-        brush.setPosition(sf::Vector2f(x * pixels_row, y * pixels_column));
-        this->main_window->draw(brush);
+  // Only rasterize the atlas again if the tile set changed
+  if (this->tile_atlas_loaded && std::memcmp(tiles, this->tile_cache, kIOTileSetSize) == 0)
+    return;
+  std::memcpy(this->tile_cache, tiles, kIOTileSetSize);
+
+  // The atlas is a 16x16 grid of tiles, the lower half contains the inverted tiles
+  sf::Image image;
+  image.create(16 * kIOTileSize, 16 * kIOTileSize, sf::Color::Transparent);
+  for (uint32_t tile = 0; tile < kIOTileCount * 2; tile++) {
+    uint32_t left = (tile % 16) * kIOTileSize;
+    uint32_t top = (tile / 16) * kIOTileSize;
+    bool inverted = tile >= kIOTileCount;
+    for (uint32_t y = 0; y < kIOTileSize; y++) {
+      uint8_t row = tiles[(tile % kIOTileCount) * kIOTileSize + y];
+      for (uint32_t x = 0; x < kIOTileSize; x++) {
+        bool set = (row >> x) & 0x01;
+        if (set != inverted)
+          image.setPixel(left + x, top + y, sf::Color::White);
       }
     }
+  }
+
+  this->tile_atlas.loadFromImage(image);
+  this->tile_atlas_loaded = true;
+}
+
+void IOChip::render_sprites(uint8_t* frame, uint32_t screen_width, uint32_t screen_height) {
+  uint8_t table_page = this->memory[kIOSpriteTable];
+  if (table_page == 0)
+    return;
 
-    this->main_window->display();
+  SpriteEntry sprites[kIOSpriteCount];
+  this->bus->read_block(table_page << 8, reinterpret_cast<uint8_t*>(sprites), sizeof(sprites));
+
+  // Sprites later in the table are drawn on top of earlier ones
+  uint8_t row_buffer[256];
+  for (const SpriteEntry& sprite : sprites) {
+    if (!(sprite.flags & kIOSpriteVisible))
+      continue;
+    if (sprite.x >= screen_width || sprite.y >= screen_height)
+      continue;
+
+    uint16_t data = sprite.data_lo | (sprite.data_hi << 8);
+    uint32_t row_length = std::min<uint32_t>(sprite.w, screen_width - sprite.x);
+    uint32_t row_count = std::min<uint32_t>(sprite.h, screen_height - sprite.y);
+    for (uint32_t row = 0; row < row_count; row++) {
+      this->bus->read_block(data + row * sprite.w, row_buffer, row_length);
+      uint8_t* dst = frame + sprite.x + (sprite.y + row) * screen_width;
+      for (uint32_t column = 0; column < row_length; column++) {
+        if (row_buffer[column] != sprite.color_key)
+          dst[column] = row_buffer[column];
+      }
+    }
   }
 }
 
 void IOChip::write(uint16_t address, uint8_t value) {
   this->memory[address] = value;
+  if (address < kIOVRAMSize) {
+    this->vram_dirty[address / kSnapshotPageSize] = true;
+    this->vram_golden_dirty[address / kSnapshotPageSize] = true;
+  }
+
+  // The first write to the display opens the window
+  if (!this->window_requested && this->is_display_address(address))
+    this->request_window();
 
   // Some memory locations require further processing, these are handled here
   //
@@ -295,12 +858,19 @@ void IOChip::write(uint16_t address, uint8_t value) {
   //       or disable the render thread.
   switch (address) {
     case kIOControl: {
-      this->text_mode = (value & kIOControlMode);
-      this->window_hidden = (value & kIOControlVisibility);
-      this->window_fullscreen = (value & kIOControlFullscreen);
-      this->window_portrait = (value & kIOControlOrientation);
-      this->keyboard_disabled = (value & kIOControlKeyboardDisabled);
-      this->mouse_disabled = (value & kIOControlMouseDisabled);
+      this->apply_control(value);
+
+      // Pending events are discarded if the event queue gets disabled
+      if (!(value & kIOControlEventQueue)) {
+        std::unique_lock<std::mutex> lk(this->event_mutex);
+        this->event_queue_size = 0;
+        this->event_queue_overflow = false;
+        this->irq_pending = false;
+      }
+      break;
+    }
+    case kIOEventAck: {
+      this->acknowledge_event();
       break;
     }
     case kIODrawMethod: {
@@ -310,109 +880,679 @@ void IOChip::write(uint16_t address, uint8_t value) {
       uint8_t arg3 = this->memory[kIODrawArg3];
       uint8_t arg4 = this->memory[kIODrawArg4];
 
+      // Without a drawing thread, the instruction is executed right away
+      if (this->single_threaded) {
+        this->execute_draw_instruction({value, arg1, arg2, arg3, arg4});
+        break;
+      }
+
       {
         std::unique_lock<std::shared_mutex> lk(this->draw_pipeline_mutex);
+        if (this->shutdown)
+          break;
         this->draw_pipeline.push({value, arg1, arg2, arg3, arg4});
+
+        // The drawing thread is started by the first draw instruction
+        if (!this->drawing_thread.joinable())
+          this->drawing_thread = std::thread(&IOChip::thread_drawing, this);
       }
 
       // Notify the drawing thread that there is work to do
       this->condition_draw.notify_one();
       break;
     }
+    case kIOVideoSync: {
+      // Flips only exist while double buffering is enabled, disabling it drops a pending one
+      if (!(value & kIOVideoSyncDoubleBuffer)) {
+        this->flip_pending = false;
+      } else if (value & kIOVideoSyncFlip) {
+        this->flip_pending = true;
+      }
+      break;
+    }
+    case kIOPaletteIndex: {
+      this->palette_index = value;
+      this->palette_component = 0;
+      break;
+    }
+    case kIOPaletteData: {
+      // Entries can straddle a page boundary, so the page of the component itself is marked
+      size_t page = (this->palette_index * 3 + this->palette_component) / kSnapshotPageSize;
+      this->palette_dirty[page] = true;
+      this->palette_golden_dirty[page] = true;
+      std::unique_lock<std::mutex> lk(this->palette_mutex);
+      sf::Color& entry = this->palette[this->palette_index];
+      if (this->palette_component == 0)
+        entry.r = value;
+      if (this->palette_component == 1)
+        entry.g = value;
+      if (this->palette_component == 2)
+        entry.b = value;
+
+      // Advance to the next entry once all three components are written
+      if (++this->palette_component == 3) {
+        this->palette_component = 0;
+        this->palette_index++;
+      }
+      break;
+    }
     case kIOAudioChannel1:
     case kIOAudioChannel2:
     case kIOAudioChannel3: {
       this->update_audio(address, value);
       break;
     }
+    case kIOClock1:
+    case kIOClock2: {
+      uint8_t slot = address == kIOClock1 ? kIOTimerSlotClock1 : kIOTimerSlotClock2;
+      if (value == 0) {
+        this->disarm_timer(slot);
+      } else {
+        this->arm_timer(slot, std::chrono::milliseconds(5 * value), true);
+      }
+      break;
+    }
     case kIOTimer1Lo:
     case kIOTimer2Lo: {
-      this->worker_threads.push_back(std::thread(&IOChip::thread_timer, this, address));
+      uint8_t slot = address == kIOTimer1Lo ? kIOTimerSlotTimer1 : kIOTimerSlotTimer2;
+      uint32_t timer_milliseconds = ((this->memory[address + 1] << 8) + value) * 10;
+      this->arm_timer(slot, std::chrono::milliseconds(timer_milliseconds), false);
       break;
     }
     case kIOCounter1:
     case kIOCounter2: {
-      this->worker_threads.push_back(std::thread(&IOChip::thread_counter, this, address));
+      uint8_t slot = address == kIOCounter1 ? kIOTimerSlotCounter1 : kIOTimerSlotCounter2;
+      if (value == 0) {
+        this->disarm_timer(slot);
+      } else {
+        this->arm_timer(slot, std::chrono::seconds(1), true);
+      }
       break;
     }
   }
 }
 
 uint8_t IOChip::read(uint16_t address) {
+  // The flip bit is cleared by the render thread once the flip happened
+  if (address == kIOVideoSync) {
+    uint8_t video_sync = this->memory[address] & ~kIOVideoSyncFlip;
+    return this->flip_pending ? video_sync | kIOVideoSyncFlip : video_sync;
+  }
+
+  if (address == kIOEventAck) {
+    std::unique_lock<std::mutex> lk(this->event_mutex);
+    return this->event_queue_size | (this->event_queue_overflow ? kIOEventAckOverflow : 0x00);
+  }
+
   return this->memory[address];
 }
 
 void IOChip::update_audio(uint16_t address, uint8_t value) {
-  // Decode
-  AudioChannelSettingsDecoder decoder(value);
+  std::unique_lock<std::mutex> lk(this->audio_mutex);
+
+  // Audio is started by the first write to an audio channel, headless chips never start it
+  if (!this->audio_loaded) {
+    if (this->headless || this->shutdown)
+      return;
+    this->start_audio();
+  }
+
+  this->audio_synth->write(this->audio_timestamp(), address - kIOAudioChannel1, value);
+}
+
+uint64_t IOChip::audio_timestamp() {
+  uint64_t sample = this->audio_target_sample();
+  if (this->audio_offline)
+    return std::max(sample, this->audio_synth->position());
+  sample += kIOAudioBlockSize;
+
+  // The emulated clock and the audio device drift apart over time. Writes are kept
+  // within two blocks of the stream, so the latency stays bounded.
+  uint64_t position = this->audio_synth->position();
+  return std::clamp(sample, position, position + 2 * kIOAudioBlockSize);
+}
+
+uint64_t IOChip::audio_target_sample() {
+  int64_t elapsed = std::max<int64_t>(static_cast<int64_t>(this->now_ticks()) - this->audio_origin, 0);
+  if (this->bus->is_virtual_time())
+    return elapsed * kIOAudioSampleRate / kClockRate;
+  return elapsed / 1000 * kIOAudioSampleRate / 1000000;
+}
+
+void IOChip::thread_scheduler() {
+  std::unique_lock<std::mutex> lk(this->scheduler_mutex);
+  while (!this->shutdown) {
+    // Find the slot with the earliest deadline
+    uint64_t next = kCycleNever;
+    for (TimerSlot& slot : this->timer_slots) {
+      if (slot.armed)
+        next = std::min(next, slot.deadline);
+    }
+
+    // Writes to the timer registers and shutting down wake the thread up,
+    // after which the deadlines are reevaluated
+    if (next == kCycleNever) {
+      this->condition_scheduler.wait(lk);
+      continue;
+    }
+    std::chrono::steady_clock::time_point deadline{std::chrono::nanoseconds(next)};
+    if (this->condition_scheduler.wait_until(lk, deadline) == std::cv_status::no_timeout)
+      continue;
+    if (this->shutdown)
+      break;
+
+    this->fire_due_timers(this->now_ticks());
+  }
+}
+
+uint64_t IOChip::advance(uint64_t cycle) {
+  std::unique_lock<std::mutex> lk(this->scheduler_mutex);
+  return this->fire_due_timers(cycle);
+}
+
+uint64_t IOChip::fire_due_timers(uint64_t now) {
+  uint64_t next = kCycleNever;
+  for (TimerSlot& slot : this->timer_slots) {
+    if (slot.armed && slot.deadline <= now)
+      this->fire_timer(slot, now);
+    if (slot.armed)
+      next = std::min(next, slot.deadline);
+  }
+  return next;
+}
+
+void IOChip::arm_timer(uint8_t slot, std::chrono::nanoseconds period, bool periodic) {
+  std::unique_lock<std::mutex> lk(this->scheduler_mutex);
+  TimerSlot& timer = this->timer_slots[slot];
+
+  // The scheduler thread is started by the first clock, timer or counter
+  if (!this->bus->is_virtual_time() && !this->scheduler_thread.joinable()) {
+    if (this->shutdown)
+      return;
+    this->scheduler_thread = std::thread(&IOChip::thread_scheduler, this);
+  }
+
+  // A running periodic source keeps its phase, the new period applies after the next interrupt
+  if (!(timer.armed && timer.periodic && periodic))
+    timer.deadline = this->now_ticks() + this->to_ticks(period);
+
+  timer.armed = true;
+  timer.period = this->to_ticks(period);
+  timer.periodic = periodic;
+
+  if (this->bus->is_virtual_time()) {
+    this->bus->schedule_event(timer.deadline);
+  } else {
+    this->condition_scheduler.notify_one();
+  }
+}
+
+void IOChip::disarm_timer(uint8_t slot) {
+  std::unique_lock<std::mutex> lk(this->scheduler_mutex);
+  this->timer_slots[slot].armed = false;
+  this->condition_scheduler.notify_one();
+}
+
+void IOChip::fire_timer(TimerSlot& slot, uint64_t now) {
+  this->raise_event(slot.event_type);
+
+  if (!slot.periodic) {
+    slot.armed = false;
+    return;
+  }
+
+  // Counters decrement their value and stop once it reaches 0
+  if (slot.event_type == kIOEventCounter1 || slot.event_type == kIOEventCounter2) {
+    if (this->memory[slot.address] > 0)
+      this->memory[slot.address]--;
+    if (this->memory[slot.address] == 0) {
+      slot.armed = false;
+      return;
+    }
+  }
+
+  // Advance by whole periods so the source doesn't drift. If we fell behind by more
+  // than a period, skip the missed interrupts instead of firing them in a burst.
+  slot.deadline += slot.period;
+  if (slot.deadline <= now)
+    slot.deadline = now + slot.period;
+}
+
+uint64_t IOChip::now_ticks() {
+  if (this->bus->is_virtual_time())
+    return this->bus->current_cycle();
+
+  auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch).count();
+}
+
+uint64_t IOChip::to_ticks(std::chrono::nanoseconds duration) {
+  if (this->bus->is_virtual_time())
+    return duration.count() * kClockRate / 1000000000;
+  return duration.count();
+}
+
+std::chrono::nanoseconds IOChip::from_ticks(uint64_t ticks) {
+  if (this->bus->is_virtual_time())
+    return std::chrono::nanoseconds(ticks * 1000000000 / kClockRate);
+  return std::chrono::nanoseconds(ticks);
+}
+
+void IOChip::apply_control(uint8_t value) {
+  this->text_mode = (value & kIOControlMode);
+  this->window_hidden = (value & kIOControlVisibility);
+  this->window_fullscreen = (value & kIOControlFullscreen);
+  this->window_portrait = (value & kIOControlOrientation);
+  this->keyboard_disabled = (value & kIOControlKeyboardDisabled);
+  this->mouse_disabled = (value & kIOControlMouseDisabled);
+}
+
+void IOChip::snapshot(SnapshotWriter& writer) {
+  writer.write_block(this->memory, sizeof(this->memory));
+  writer.write_block(this->front_vram, kIOVRAMSize);
+  writer.write_byte(this->flip_pending);
+  writer.write_byte(this->window_requested);
+
+  uint8_t palette_data[kIOPaletteDataSize];
+  this->get_palette_data(palette_data);
+  writer.write_block(palette_data, sizeof(palette_data));
+
+  this->snapshot_state(writer);
+}
 
-  // Get the source buffer for the sound
-  sf::SoundBuffer* source_buffer = nullptr;
-  if (decoder.wave_function == kIOAudioChannelWaveSine)
-    source_buffer = &this->audio_buffer_sine;
-  if (decoder.wave_function == kIOAudioChannelWaveSquare)
-    source_buffer = &this->audio_buffer_square;
-  if (decoder.wave_function == kIOAudioChannelWaveSaw)
-    source_buffer = &this->audio_buffer_saw;
-  if (decoder.wave_function == kIOAudioChannelWaveTriangle)
-    source_buffer = &this->audio_buffer_triangle;
+void IOChip::restore(SnapshotReader& reader) {
+  // VRAM changes as a whole, just like during a draw instruction
+  this->vram_sequence.fetch_add(1, std::memory_order_acq_rel);
+  reader.read_block(this->memory, sizeof(this->memory));
+  this->vram_sequence.fetch_add(1, std::memory_order_release);
+  this->apply_control(this->control);
+
+  reader.read_block(this->front_vram, kIOVRAMSize);
+  this->flip_pending = reader.read_byte();
+  if (reader.read_byte() && !this->window_requested)
+    this->request_window();
+
+  uint8_t palette_data[kIOPaletteDataSize];
+  reader.read_block(palette_data, sizeof(palette_data));
+  this->set_palette_data(palette_data);
+
+  // Every page could differ from the previous incremental snapshot and the golden state now
+  std::fill(this->vram_dirty, this->vram_dirty + kIOVRAMPageCount, true);
+  std::fill(this->front_vram_dirty, this->front_vram_dirty + kIOVRAMPageCount, true);
+  std::fill(this->palette_dirty, this->palette_dirty + kIOPalettePageCount, true);
+  std::fill(this->vram_golden_dirty, this->vram_golden_dirty + kIOVRAMPageCount, true);
+  std::fill(this->front_vram_golden_dirty, this->front_vram_golden_dirty + kIOVRAMPageCount, true);
+  std::fill(this->palette_golden_dirty, this->palette_golden_dirty + kIOPalettePageCount, true);
+
+  this->restore_state(reader);
+}
+
+void IOChip::snapshot_delta(SnapshotWriter& writer) {
+  writer.write_pages(this->vram, this->vram_shadow, this->vram_dirty, kIOVRAMSize);
+  writer.write_pages(this->front_vram, this->front_vram_shadow, this->front_vram_dirty, kIOVRAMSize);
 
-  // Get the target audio channel
-  sf::Sound* target_channel = nullptr;
-  AudioChannelSettingsDecoder* target_cache = nullptr;
-  if (address == kIOAudioChannel1) {
-    target_channel = &this->audio_sound1;
-    target_cache = &this->audio_cache1;
+  uint8_t palette_data[kIOPaletteDataSize];
+  this->get_palette_data(palette_data);
+  writer.write_pages(palette_data, this->palette_shadow, this->palette_dirty, kIOPaletteDataSize);
+
+  writer.write_block(this->memory + kIOVRAMSize, sizeof(this->memory) - kIOVRAMSize);
+  writer.write_byte(this->flip_pending);
+  writer.write_byte(this->window_requested);
+  this->snapshot_state(writer);
+}
+
+void IOChip::restore_delta(SnapshotReader& reader, bool undo_pages, bool restore_state) {
+  this->vram_sequence.fetch_add(1, std::memory_order_acq_rel);
+  reader.read_pages(this->vram, this->vram_shadow, kIOVRAMSize, undo_pages);
+  this->vram_sequence.fetch_add(1, std::memory_order_release);
+  reader.read_pages(this->front_vram, this->front_vram_shadow, kIOVRAMSize, undo_pages);
+
+  uint8_t palette_data[kIOPaletteDataSize];
+  this->get_palette_data(palette_data);
+  reader.read_pages(palette_data, this->palette_shadow, kIOPaletteDataSize, undo_pages);
+  if (undo_pages) {
+    this->set_palette_data(palette_data);
+
+    // The pages which were put back aren't known here
+    std::fill(this->vram_golden_dirty, this->vram_golden_dirty + kIOVRAMPageCount, true);
+    std::fill(this->front_vram_golden_dirty, this->front_vram_golden_dirty + kIOVRAMPageCount, true);
+    std::fill(this->palette_golden_dirty, this->palette_golden_dirty + kIOPalettePageCount, true);
   }
-  if (address == kIOAudioChannel2) {
-    target_channel = &this->audio_sound2;
-    target_cache = &this->audio_cache1;
+
+  if (!restore_state)
+    return;
+
+  reader.read_block(this->memory + kIOVRAMSize, sizeof(this->memory) - kIOVRAMSize);
+  this->apply_control(this->control);
+  this->flip_pending = reader.read_byte();
+  if (reader.read_byte() && !this->window_requested)
+    this->request_window();
+
+  this->restore_state(reader);
+}
+
+void IOChip::save_golden(SnapshotWriter&) {
+  if (this->golden == nullptr)
+    this->golden = std::make_unique<IOGoldenState>();
+  IOGoldenState& golden = *this->golden;
+
+  this->snapshot_vram(golden.memory);
+  std::memcpy(golden.memory + kIOVRAMSize, this->memory + kIOVRAMSize, sizeof(this->memory) - kIOVRAMSize);
+  std::memcpy(golden.front_vram, this->front_vram, kIOVRAMSize);
+  this->get_palette_data(golden.palette_data);
+  golden.flip_pending = this->flip_pending;
+  golden.window_requested = this->window_requested;
+
+  golden.palette_index = this->palette_index;
+  golden.palette_component = this->palette_component;
+  golden.brush_body_color = this->brush_body_color;
+  golden.brush_outline_color = this->brush_outline_color;
+  golden.brush_origin_x = this->brush_origin_x;
+  golden.brush_origin_y = this->brush_origin_y;
+  golden.brush_source = this->brush_source;
+  golden.brush_stride = this->brush_stride;
+  golden.brush_key = this->brush_key;
+  golden.brush_key_enabled = this->brush_key_enabled;
+  golden.mouse_pixel_x = this->mouse_pixel_x;
+  golden.mouse_pixel_y = this->mouse_pixel_y;
+
+  {
+    std::unique_lock<std::mutex> lk(this->event_mutex);
+    std::copy(this->event_queue, this->event_queue + kIOEventQueueSize, golden.event_queue);
+    golden.event_queue_head = this->event_queue_head;
+    golden.event_queue_size = this->event_queue_size;
+    golden.event_queue_overflow = this->event_queue_overflow;
+    golden.irq_pending = this->irq_pending;
   }
-  if (address == kIOAudioChannel3) {
-    target_channel = &this->audio_sound3;
-    target_cache = &this->audio_cache1;
+
+  {
+    std::shared_lock<std::shared_mutex> lk(this->draw_pipeline_mutex);
+    golden.draw_pipeline = this->draw_pipeline;
   }
 
-  // Update the audio channel
-  if (decoder.volume != target_cache->volume) {
-    if (decoder.volume == 0) {
-      target_channel->pause();
+  {
+    std::unique_lock<std::mutex> lk(this->scheduler_mutex);
+    uint64_t now = this->now_ticks();
+    for (size_t i = 0; i < kIOTimerSlotCount; i++) {
+      golden.timer_slots[i] = this->timer_slots[i];
+      golden.timer_slots[i].deadline = this->timer_slots[i].deadline > now ? this->timer_slots[i].deadline - now : 0;
     }
-    target_channel->setVolume(decoder.volume);
   }
-  if (decoder.pitch != target_cache->pitch) {
-    target_channel->setPitch(decoder.pitch);
+
+  std::fill(this->vram_golden_dirty, this->vram_golden_dirty + kIOVRAMPageCount, false);
+  std::fill(this->front_vram_golden_dirty, this->front_vram_golden_dirty + kIOVRAMPageCount, false);
+  std::fill(this->palette_golden_dirty, this->palette_golden_dirty + kIOPalettePageCount, false);
+}
+
+void IOChip::restore_golden(SnapshotReader&) {
+  if (this->golden == nullptr)
+    return;
+  const IOGoldenState& golden = *this->golden;
+
+  // Only the pages modified since the golden state was saved are put back, they're also modified
+  // with respect to the previous incremental snapshot
+  this->vram_sequence.fetch_add(1, std::memory_order_acq_rel);
+  for (size_t page = 0; page < kIOVRAMPageCount; page++) {
+    if (!this->vram_golden_dirty[page])
+      continue;
+    size_t offset = page * kSnapshotPageSize;
+    size_t length = std::min(kSnapshotPageSize, kIOVRAMSize - offset);
+    std::memcpy(this->vram + offset, golden.memory + offset, length);
+    this->vram_golden_dirty[page] = false;
+    this->vram_dirty[page] = true;
+  }
+  std::memcpy(this->memory + kIOVRAMSize, golden.memory + kIOVRAMSize, sizeof(this->memory) - kIOVRAMSize);
+  this->vram_sequence.fetch_add(1, std::memory_order_release);
+  this->apply_control(this->control);
+
+  for (size_t page = 0; page < kIOVRAMPageCount; page++) {
+    if (!this->front_vram_golden_dirty[page])
+      continue;
+    size_t offset = page * kSnapshotPageSize;
+    size_t length = std::min(kSnapshotPageSize, kIOVRAMSize - offset);
+    std::memcpy(this->front_vram + offset, golden.front_vram + offset, length);
+    this->front_vram_golden_dirty[page] = false;
+    this->front_vram_dirty[page] = true;
+  }
+
+  if (std::find(this->palette_golden_dirty, this->palette_golden_dirty + kIOPalettePageCount, true) !=
+      this->palette_golden_dirty + kIOPalettePageCount) {
+    uint8_t palette_data[kIOPaletteDataSize];
+    this->get_palette_data(palette_data);
+    for (size_t page = 0; page < kIOPalettePageCount; page++) {
+      if (!this->palette_golden_dirty[page])
+        continue;
+      size_t offset = page * kSnapshotPageSize;
+      size_t length = std::min(kSnapshotPageSize, kIOPaletteDataSize - offset);
+      std::memcpy(palette_data + offset, golden.palette_data + offset, length);
+      this->palette_golden_dirty[page] = false;
+      this->palette_dirty[page] = true;
+    }
+    this->set_palette_data(palette_data);
+  }
+
+  this->flip_pending = golden.flip_pending;
+  if (golden.window_requested && !this->window_requested)
+    this->request_window();
+
+  this->palette_index = golden.palette_index;
+  this->palette_component = golden.palette_component;
+  this->brush_body_color = golden.brush_body_color;
+  this->brush_outline_color = golden.brush_outline_color;
+  this->brush_origin_x = golden.brush_origin_x;
+  this->brush_origin_y = golden.brush_origin_y;
+  this->brush_source = golden.brush_source;
+  this->brush_stride = golden.brush_stride;
+  this->brush_key = golden.brush_key;
+  this->brush_key_enabled = golden.brush_key_enabled;
+  this->mouse_pixel_x = golden.mouse_pixel_x;
+  this->mouse_pixel_y = golden.mouse_pixel_y;
+
+  // The IRQ line of the CPU has been restored with the CPU, so restored events don't interrupt it again
+  {
+    std::unique_lock<std::mutex> lk(this->event_mutex);
+    std::copy(golden.event_queue, golden.event_queue + kIOEventQueueSize, this->event_queue);
+    this->event_queue_head = golden.event_queue_head;
+    this->event_queue_size = golden.event_queue_size;
+    this->event_queue_overflow = golden.event_queue_overflow;
+    this->irq_pending = golden.irq_pending;
   }
-  if (decoder.wave_function != target_cache->wave_function) {
-    target_channel->setBuffer(*source_buffer);
+
+  // Single threaded chips execute draw instructions right away, so only threaded ones have any pending
+  {
+    std::unique_lock<std::shared_mutex> lk(this->draw_pipeline_mutex);
+    this->draw_pipeline = golden.draw_pipeline;
+    if (!this->draw_pipeline.empty() && !this->drawing_thread.joinable() && !this->shutdown)
+      this->drawing_thread = std::thread(&IOChip::thread_drawing, this);
   }
-  if (decoder.volume != 0) {
-    target_channel->play();
+  this->condition_draw.notify_one();
+
+  {
+    std::unique_lock<std::mutex> lk(this->scheduler_mutex);
+    uint64_t now = this->now_ticks();
+    for (size_t i = 0; i < kIOTimerSlotCount; i++) {
+      this->timer_slots[i] = golden.timer_slots[i];
+      this->timer_slots[i].deadline = now + golden.timer_slots[i].deadline;
+    }
+    this->schedule_restored_timers();
   }
 
-  *target_cache = decoder;
+  this->resume_audio();
 }
 
-void IOChip::thread_timer(uint16_t address) {
-  uint8_t lo = this->memory[address];
-  uint8_t hi = this->memory[address + 1];
-  uint32_t timer_milliseconds = ((hi << 8) + lo) * 10;
-  std::this_thread::sleep_for(std::chrono::milliseconds(timer_milliseconds));
-  if (!this->shutdown) {
-    uint8_t event_type = address == kIOTimer1Lo ? kIOEventTimer1 : kIOEventTimer2;
-    this->memory[kIOEventType] = event_type;
-    this->bus->int_irq();
+void IOChip::get_palette_data(uint8_t* data) {
+  for (int i = 0; i < 256; i++) {
+    data[i * 3] = this->palette[i].r;
+    data[i * 3 + 1] = this->palette[i].g;
+    data[i * 3 + 2] = this->palette[i].b;
   }
 }
 
-void IOChip::thread_counter(uint16_t address) {
-  uint8_t seconds = this->memory[address];
-  while (!this->shutdown && seconds) {
-    std::this_thread::sleep_for(std::chrono::seconds(1));
-    uint8_t event_type = address == kIOCounter1 ? kIOEventCounter1 : kIOEventCounter2;
-    this->memory[kIOEventType] = event_type;
-    this->bus->int_irq();
-    seconds = this->memory[address];
+void IOChip::set_palette_data(const uint8_t* data) {
+  std::unique_lock<std::mutex> lk(this->palette_mutex);
+  for (int i = 0; i < 256; i++)
+    this->palette[i] = sf::Color(data[i * 3], data[i * 3 + 1], data[i * 3 + 2]);
+}
+
+void IOChip::snapshot_state(SnapshotWriter& writer) {
+  writer.write_byte(this->palette_index);
+  writer.write_byte(this->palette_component);
+
+  writer.write_byte(this->brush_body_color);
+  writer.write_byte(this->brush_outline_color);
+  writer.write_byte(this->brush_origin_x);
+  writer.write_byte(this->brush_origin_y);
+  writer.write_word(this->brush_source);
+  writer.write_byte(this->brush_stride);
+  writer.write_byte(this->brush_key);
+  writer.write_byte(this->brush_key_enabled);
+
+  writer.write_byte(this->mouse_pixel_x);
+  writer.write_byte(this->mouse_pixel_y);
+
+  {
+    std::unique_lock<std::mutex> lk(this->event_mutex);
+    writer.write_byte(this->event_queue_size);
+    writer.write_byte(this->event_queue_overflow);
+    writer.write_byte(this->irq_pending);
+    for (size_t i = 0; i < this->event_queue_size; i++) {
+      const IOEvent& event = this->event_queue[(this->event_queue_head + i) % kIOEventQueueSize];
+      writer.write_byte(event.type);
+      writer.write_byte(event.payload1);
+      writer.write_byte(event.payload2);
+      writer.write_byte(event.high_priority);
+    }
+  }
+
+  // Draw instructions the drawing thread hasn't gotten to yet
+  {
+    std::shared_lock<std::shared_mutex> lk(this->draw_pipeline_mutex);
+    std::queue<DrawInstruction> pipeline = this->draw_pipeline;
+    writer.write_long(pipeline.size());
+    for (; !pipeline.empty(); pipeline.pop()) {
+      const DrawInstruction& instruction = pipeline.front();
+      writer.write_byte(instruction.method_code);
+      writer.write_byte(instruction.arg1);
+      writer.write_byte(instruction.arg2);
+      writer.write_byte(instruction.arg3);
+      writer.write_byte(instruction.arg4);
+    }
+  }
+
+  // Timers are stored in nanoseconds, independent of the time base
+  {
+    std::unique_lock<std::mutex> lk(this->scheduler_mutex);
+    uint64_t now = this->now_ticks();
+    for (const TimerSlot& slot : this->timer_slots) {
+      uint64_t remaining = slot.deadline > now ? slot.deadline - now : 0;
+      writer.write_byte(slot.armed);
+      writer.write_byte(slot.periodic);
+      writer.write_quad(this->from_ticks(remaining).count());
+      writer.write_quad(this->from_ticks(slot.period).count());
+    }
+  }
+}
+
+void IOChip::restore_state(SnapshotReader& reader) {
+  this->palette_index = reader.read_byte();
+  this->palette_component = reader.read_byte() % 3;
+
+  this->brush_body_color = reader.read_byte();
+  this->brush_outline_color = reader.read_byte();
+  this->brush_origin_x = reader.read_byte();
+  this->brush_origin_y = reader.read_byte();
+  this->brush_source = reader.read_word();
+  this->brush_stride = reader.read_byte();
+  this->brush_key = reader.read_byte();
+  this->brush_key_enabled = reader.read_byte();
+
+  this->mouse_pixel_x = reader.read_byte();
+  this->mouse_pixel_y = reader.read_byte();
+
+  // The IRQ line of the CPU has been restored with the CPU, so restored events don't interrupt it again
+  {
+    std::unique_lock<std::mutex> lk(this->event_mutex);
+    this->event_queue_head = 0;
+    this->event_queue_size = std::min<size_t>(reader.read_byte(), kIOEventQueueSize);
+    this->event_queue_overflow = reader.read_byte();
+    this->irq_pending = reader.read_byte();
+    for (size_t i = 0; i < this->event_queue_size; i++) {
+      IOEvent& event = this->event_queue[i];
+      event.type = reader.read_byte();
+      event.payload1 = reader.read_byte();
+      event.payload2 = reader.read_byte();
+      event.high_priority = reader.read_byte();
+    }
+  }
+
+  {
+    std::unique_lock<std::shared_mutex> lk(this->draw_pipeline_mutex);
+    this->draw_pipeline = std::queue<DrawInstruction>();
+    uint32_t count = reader.read_long();
+    for (uint32_t i = 0; i < count && !reader.failed(); i++) {
+      DrawInstruction instruction;
+      instruction.method_code = reader.read_byte();
+      instruction.arg1 = reader.read_byte();
+      instruction.arg2 = reader.read_byte();
+      instruction.arg3 = reader.read_byte();
+      instruction.arg4 = reader.read_byte();
+      if (this->single_threaded) {
+        this->execute_draw_instruction(instruction);
+      } else {
+        this->draw_pipeline.push(instruction);
+      }
+    }
+
+    if (!this->draw_pipeline.empty() && !this->drawing_thread.joinable() && !this->shutdown)
+      this->drawing_thread = std::thread(&IOChip::thread_drawing, this);
+  }
+  this->condition_draw.notify_one();
+
+  {
+    std::unique_lock<std::mutex> lk(this->scheduler_mutex);
+    uint64_t now = this->now_ticks();
+    for (TimerSlot& slot : this->timer_slots) {
+      slot.armed = reader.read_byte();
+      slot.periodic = reader.read_byte();
+      slot.deadline = now + this->to_ticks(std::chrono::nanoseconds(reader.read_quad()));
+      slot.period = this->to_ticks(std::chrono::nanoseconds(reader.read_quad()));
+    }
+    this->schedule_restored_timers();
+  }
+
+  this->resume_audio();
+}
+
+void IOChip::schedule_restored_timers() {
+  bool any_armed = false;
+  for (TimerSlot& slot : this->timer_slots) {
+    if (!slot.armed)
+      continue;
+
+    any_armed = true;
+    if (this->bus->is_virtual_time())
+      this->bus->schedule_event(slot.deadline);
+  }
+
+  if (any_armed && !this->bus->is_virtual_time() && !this->scheduler_thread.joinable() && !this->shutdown)
+    this->scheduler_thread = std::thread(&IOChip::thread_scheduler, this);
+  this->condition_scheduler.notify_one();
+}
+
+void IOChip::resume_audio() {
+  // Audio continues at the current position of the stream
+  {
+    std::unique_lock<std::mutex> lk(this->audio_mutex);
+    if (this->audio_loaded) {
+      uint64_t elapsed = this->to_ticks(
+          std::chrono::nanoseconds(this->audio_synth->position() * 1000000000 / kIOAudioSampleRate));
+      this->audio_origin = static_cast<int64_t>(this->now_ticks()) - static_cast<int64_t>(elapsed);
+    }
+  }
+  for (size_t i = 0; i < kIOAudioChannelCount; i++) {
+    uint8_t value = this->memory[kIOAudioChannel1 + i];
+    if (this->audio_loaded || (value & kIOAudioChannelVolume))
+      this->update_audio(kIOAudioChannel1 + i, value);
   }
 }
 
@@ -510,4 +1650,120 @@ void IOChip::draw_line(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2) {
   }
 }
 
+void IOChip::draw_clear() {
+  std::memset(this->vram, this->brush_body_color, kIOVRAMSize);
+}
+
+void IOChip::draw_fill(uint8_t x, uint8_t y, uint8_t w, uint8_t h) {
+  bool portrait_mode = this->control & kIOControlOrientation;
+  uint32_t screen_width = portrait_mode ? kIOVideoHeight : kIOVideoWidth;
+  uint32_t screen_height = portrait_mode ? kIOVideoWidth : kIOVideoHeight;
+  if (x >= screen_width || y >= screen_height)
+    return;
+
+  // Clip the region to the screen
+  uint32_t row_length = std::min<uint32_t>(w, screen_width - x);
+  uint32_t row_count = std::min<uint32_t>(h, screen_height - y);
+  uint8_t color = this->brush_body_color;
+
+  // Rows spanning the whole screen are contiguous in VRAM
+  if (row_length == screen_width) {
+    std::memset(this->vram + y * screen_width, color, row_length * row_count);
+    return;
+  }
+
+  for (uint32_t row = 0; row < row_count; row++) {
+    std::memset(this->vram + x + (y + row) * screen_width, color, row_length);
+  }
+}
+
+void IOChip::draw_copy(uint8_t x, uint8_t y, uint8_t w, uint8_t h) {
+  bool portrait_mode = this->control & kIOControlOrientation;
+  uint32_t screen_width = portrait_mode ? kIOVideoHeight : kIOVideoWidth;
+  uint32_t screen_height = portrait_mode ? kIOVideoWidth : kIOVideoHeight;
+  uint32_t src_x = this->brush_origin_x;
+  uint32_t src_y = this->brush_origin_y;
+  if (x >= screen_width || y >= screen_height || src_x >= screen_width || src_y >= screen_height)
+    return;
+
+  // Clip both the source and the destination region to the screen
+  uint32_t row_length = std::min<uint32_t>(w, screen_width - std::max<uint32_t>(x, src_x));
+  uint32_t row_count = std::min<uint32_t>(h, screen_height - std::max<uint32_t>(y, src_y));
+
+  // Copy bottom-up if the destination lies below the source, so overlapping
+  // rows are read before they get overwritten
+  for (uint32_t i = 0; i < row_count; i++) {
+    uint32_t row = y > src_y ? row_count - 1 - i : i;
+    uint8_t* dst = this->vram + x + (y + row) * screen_width;
+    uint8_t* src = this->vram + src_x + (src_y + row) * screen_width;
+    std::memmove(dst, src, row_length);
+  }
+}
+
+void IOChip::draw_blit(uint8_t x, uint8_t y, uint8_t w, uint8_t h) {
+  bool portrait_mode = this->control & kIOControlOrientation;
+  uint32_t screen_width = portrait_mode ? kIOVideoHeight : kIOVideoWidth;
+  uint32_t screen_height = portrait_mode ? kIOVideoWidth : kIOVideoHeight;
+  if (x >= screen_width || y >= screen_height)
+    return;
+
+  // A stride of 0 means the source rows are tightly packed
+  uint32_t stride = this->brush_stride ? this->brush_stride : w;
+  uint32_t row_length = std::min<uint32_t>(w, screen_width - x);
+  uint32_t row_count = std::min<uint32_t>(h, screen_height - y);
+
+  uint8_t row_buffer[256];
+  for (uint32_t row = 0; row < row_count; row++) {
+    uint16_t src = this->brush_source + row * stride;
+    uint8_t* dst = this->vram + x + (y + row) * screen_width;
+    if (!this->brush_key_enabled) {
+      this->bus->read_block(src, dst, row_length);
+      continue;
+    }
+
+    // Skip pixels matching the color key
+    this->bus->read_block(src, row_buffer, row_length);
+    for (uint32_t column = 0; column < row_length; column++) {
+      if (row_buffer[column] != this->brush_key)
+        dst[column] = row_buffer[column];
+    }
+  }
+}
+
+void IOChip::draw_scroll(int8_t dx, int8_t dy) {
+  bool portrait_mode = this->control & kIOControlOrientation;
+  int32_t screen_width = portrait_mode ? kIOVideoHeight : kIOVideoWidth;
+  int32_t screen_height = portrait_mode ? kIOVideoWidth : kIOVideoHeight;
+  uint8_t color = this->brush_body_color;
+
+  // Scrolling by more than the screen size clears it
+  if (std::abs(dx) >= screen_width || std::abs(dy) >= screen_height) {
+    this->draw_clear();
+    return;
+  }
+
+  // Vertical scrolling moves whole rows, which are contiguous in VRAM
+  if (dy > 0) {
+    std::memmove(this->vram + dy * screen_width, this->vram, (screen_height - dy) * screen_width);
+    std::memset(this->vram, color, dy * screen_width);
+  } else if (dy < 0) {
+    std::memmove(this->vram, this->vram - dy * screen_width, (screen_height + dy) * screen_width);
+    std::memset(this->vram + (screen_height + dy) * screen_width, color, -dy * screen_width);
+  }
+
+  // Horizontal scrolling has to move every row on its own
+  if (dx != 0) {
+    for (int32_t row = 0; row < screen_height; row++) {
+      uint8_t* line = this->vram + row * screen_width;
+      if (dx > 0) {
+        std::memmove(line + dx, line, screen_width - dx);
+        std::memset(line, color, dx);
+      } else {
+        std::memmove(line, line - dx, screen_width + dx);
+        std::memset(line + screen_width + dx, color, -dx);
+      }
+    }
+  }
+}
+
 }  // namespace M6502
@@ -0,0 +1,533 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "lockstep.h"
+
+namespace M6502 {
+
+// Updates the sign and zero flags for a result
+static inline uint8_t update_sign_zero(uint8_t status, uint8_t value) {
+  return (status & ~(kMaskSign | kMaskZero)) | (value & kMaskSign) | (value ? 0 : kMaskZero);
+}
+
+// Updates a single status flag
+static inline uint8_t update_flag(uint8_t status, uint8_t flag, bool value) {
+  return (status & ~flag) | (value ? flag : 0);
+}
+
+LockstepEngine::LockstepEngine(MachinePool* pool)
+    : pool(pool), ram_size(pool->get_ram_size()), ram(kAddrRAM), rom(kAddrROM), cpu(&this->bus) {
+  this->ram.size = this->ram_size;
+  this->rom.memory = pool->get_rom();
+  this->rom.size = kSizeROM;
+  this->rom.writable = false;
+  this->bus.attach_ram(&this->ram);
+  this->bus.attach_rom(&this->rom);
+  this->bus.enable_virtual_time();
+
+  struct {
+    CPU::CodeExec code;
+    uint8_t operation;
+    uint8_t flag;
+  } operations[] = {
+      {&CPU::op_lda, kLockstepLDA, 0},
+      {&CPU::op_ldx, kLockstepLDX, 0},
+      {&CPU::op_ldy, kLockstepLDY, 0},
+      {&CPU::op_sta, kLockstepSTA, 0},
+      {&CPU::op_stx, kLockstepSTX, 0},
+      {&CPU::op_sty, kLockstepSTY, 0},
+      {&CPU::op_adc, kLockstepADC, 0},
+      {&CPU::op_sbc, kLockstepSBC, 0},
+      {&CPU::op_and, kLockstepAND, 0},
+      {&CPU::op_ora, kLockstepORA, 0},
+      {&CPU::op_eor, kLockstepEOR, 0},
+      {&CPU::op_bit, kLockstepBIT, 0},
+      {&CPU::op_cmp, kLockstepCMP, 0},
+      {&CPU::op_cpx, kLockstepCPX, 0},
+      {&CPU::op_cpy, kLockstepCPY, 0},
+      {&CPU::op_inc, kLockstepINC, 0},
+      {&CPU::op_dec, kLockstepDEC, 0},
+      {&CPU::op_inx, kLockstepINX, 0},
+      {&CPU::op_iny, kLockstepINY, 0},
+      {&CPU::op_dex, kLockstepDEX, 0},
+      {&CPU::op_dey, kLockstepDEY, 0},
+      {&CPU::op_tax, kLockstepTAX, 0},
+      {&CPU::op_tay, kLockstepTAY, 0},
+      {&CPU::op_txa, kLockstepTXA, 0},
+      {&CPU::op_tya, kLockstepTYA, 0},
+      {&CPU::op_clc, kLockstepCLC, 0},
+      {&CPU::op_sec, kLockstepSEC, 0},
+      {&CPU::op_nop, kLockstepNOP, 0},
+      {&CPU::op_jmp, kLockstepJMP, 0},
+      {&CPU::op_bcs, kLockstepBranchSet, kMaskCarry},
+      {&CPU::op_bcc, kLockstepBranchClear, kMaskCarry},
+      {&CPU::op_beq, kLockstepBranchSet, kMaskZero},
+      {&CPU::op_bne, kLockstepBranchClear, kMaskZero},
+      {&CPU::op_bmi, kLockstepBranchSet, kMaskSign},
+      {&CPU::op_bpl, kLockstepBranchClear, kMaskSign},
+      {&CPU::op_bvs, kLockstepBranchSet, kMaskOverflow},
+      {&CPU::op_bvc, kLockstepBranchClear, kMaskOverflow},
+  };
+  struct {
+    CPU::AddrExec addr;
+    uint8_t mode;
+  } modes[] = {
+      {&CPU::addr_implied, kLockstepImplied},
+      {&CPU::addr_immediate, kLockstepImmediate},
+      {&CPU::addr_absolute_zero, kLockstepZero},
+      {&CPU::addr_x_indexed_zero, kLockstepZeroX},
+      {&CPU::addr_y_indexed_zero, kLockstepZeroY},
+      {&CPU::addr_absolute, kLockstepAbsolute},
+      {&CPU::addr_x_indexed, kLockstepAbsoluteX},
+      {&CPU::addr_y_indexed, kLockstepAbsoluteY},
+  };
+
+  // Everything else, including odd combinations like ASL with the accumulator address mode, is left
+  // to the fallback
+  for (int i = 0; i < 256; i++) {
+    this->table[i] = {kLockstepFallback, kLockstepImplied, 0};
+    for (auto& operation : operations) {
+      if (operation.code != CPU::dispatch_table[i].code)
+        continue;
+      for (auto& mode : modes) {
+        if (mode.addr == CPU::dispatch_table[i].addr)
+          this->table[i] = {operation.operation, mode.mode, operation.flag};
+      }
+    }
+  }
+}
+
+void LockstepEngine::run_for(size_t first, size_t last, uint64_t cycles) {
+  MachinePool& pool = *this->pool;
+
+  Group group;
+  for (size_t base = first; base < last; base += kLockstepLanes) {
+    group.count = std::min(kLockstepLanes, last - base);
+    for (size_t l = 0; l < kLockstepLanes; l++) {
+      size_t i = base + std::min(l, group.count - 1);
+      group.A[l] = pool.A[i];
+      group.X[l] = pool.X[i];
+      group.Y[l] = pool.Y[i];
+      group.SP[l] = pool.SP[i];
+      group.STATUS[l] = pool.STATUS[i];
+      group.flags[l] = pool.flags[i];
+      group.PC[l] = pool.PC[i];
+      group.cycles[l] = pool.cycles[i];
+      group.instructions[l] = pool.instructions[i];
+      group.ram[l] = pool.get_ram(i);
+
+      // Lanes past the end of the range don't run
+      group.end[l] = l < group.count ? pool.cycles[i] + cycles : 0;
+    }
+
+    this->run_group(group);
+
+    for (size_t l = 0; l < group.count; l++) {
+      size_t i = base + l;
+      pool.A[i] = group.A[l];
+      pool.X[i] = group.X[l];
+      pool.Y[i] = group.Y[l];
+      pool.SP[i] = group.SP[l];
+      pool.STATUS[i] = group.STATUS[l];
+      pool.flags[i] = group.flags[l];
+      pool.PC[i] = group.PC[l];
+      pool.cycles[i] = group.cycles[l];
+      pool.instructions[i] = group.instructions[l];
+    }
+  }
+}
+
+void LockstepEngine::run_group(Group& group) {
+  // Amount of steps each lane has been masked out for
+  uint32_t waiting[kLockstepLanes] = {};
+
+  // The lanes executed by a step are followed until a branch splits them up, lanes waiting at the
+  // address they get to join them
+  uint16_t pc = 0;
+  bool follow = false;
+
+  for (;;) {
+    bool live[kLockstepLanes];
+    size_t first = kLockstepLanes;
+    bool starving = false;
+    bool following = false;
+    for (size_t l = 0; l < kLockstepLanes; l++) {
+      live[l] = group.flags[l] != kMachinePoolHalted && group.cycles[l] < group.end[l];
+      starving |= live[l] && waiting[l] >= kLockstepPatience;
+      following |= live[l] && group.PC[l] == pc;
+      if (live[l] && first == kLockstepLanes)
+        first = l;
+    }
+    if (first == kLockstepLanes)
+      return;
+
+    if (!follow || !following || starving) {
+      bool diverged = false;
+      for (size_t l = 0; l < kLockstepLanes; l++)
+        diverged |= live[l] && group.PC[l] != group.PC[first];
+      pc = group.PC[diverged ? this->pick_leader(group, live, waiting) : first];
+    }
+
+    bool mask[kLockstepLanes];
+    for (size_t l = 0; l < kLockstepLanes; l++) {
+      mask[l] = live[l] && group.PC[l] == pc;
+      waiting[l] = mask[l] ? 0 : waiting[l] + live[l];
+    }
+
+    if (!this->step_vector(group, mask, pc))
+      this->step_scalar(group, mask);
+
+    // Check whether the lanes still agree
+    size_t lane = std::find(mask, mask + kLockstepLanes, true) - mask;
+    pc = group.PC[lane];
+    follow = true;
+    for (size_t l = 0; l < kLockstepLanes; l++)
+      follow &= !mask[l] || group.PC[l] == pc;
+  }
+}
+
+size_t LockstepEngine::pick_leader(Group& group, const bool* live, const uint32_t* waiting) {
+  // Follow the address most lanes agree on, preferring lower addresses. Lanes which left a loop early
+  // would wait for the others to use up their budget otherwise, so lanes which have been waiting for
+  // too long go first.
+  for (size_t l = 0; l < kLockstepLanes; l++) {
+    if (live[l] && waiting[l] >= kLockstepPatience)
+      return l;
+  }
+
+  // Counted for all lanes at once, so it can be vectorized
+  uint8_t agreeing[kLockstepLanes] = {};
+  for (size_t other = 0; other < kLockstepLanes; other++) {
+    for (size_t l = 0; l < kLockstepLanes; l++)
+      agreeing[l] += live[other] && group.PC[other] == group.PC[l];
+  }
+
+  size_t leader = kLockstepLanes;
+  for (size_t l = 0; l < kLockstepLanes; l++) {
+    if (!live[l])
+      continue;
+    if (leader == kLockstepLanes || agreeing[l] > agreeing[leader] ||
+        (agreeing[l] == agreeing[leader] && group.PC[l] < group.PC[leader]))
+      leader = l;
+  }
+  return leader;
+}
+
+bool LockstepEngine::step_vector(Group& group, const bool* mask, uint16_t pc) {
+  // The instruction and its operands have to be in ROM, so they're the same for all lanes
+  if (pc < kAddrROM || pc > 0xFFFD)
+    return false;
+
+  const uint8_t* rom = this->pool->get_rom();
+  uint8_t opcode = rom[pc - kAddrROM];
+  LockstepInstruction instruction = this->table[opcode];
+  if (instruction.operation == kLockstepFallback)
+    return false;
+
+  // Pending resets are handled by the fallback
+  for (size_t l = 0; l < kLockstepLanes; l++) {
+    if (mask[l] && (group.flags[l] & kMachinePoolReset))
+      return false;
+  }
+
+  uint8_t operand = rom[pc + 1 - kAddrROM];
+  uint16_t word = operand | (rom[pc + 2 - kAddrROM] << 8);
+
+  // Address of the operand of every lane
+  uint16_t address[kLockstepLanes];
+  uint16_t length = 2;
+  switch (instruction.mode) {
+    case kLockstepImplied: {
+      length = 1;
+      break;
+    }
+    case kLockstepImmediate: {
+      std::fill(address, address + kLockstepLanes, pc + 1);
+      break;
+    }
+    case kLockstepZero: {
+      std::fill(address, address + kLockstepLanes, operand);
+      break;
+    }
+    case kLockstepZeroX: {
+      for (size_t l = 0; l < kLockstepLanes; l++)
+        address[l] = operand + group.X[l];
+      break;
+    }
+    case kLockstepZeroY: {
+      for (size_t l = 0; l < kLockstepLanes; l++)
+        address[l] = operand + group.Y[l];
+      break;
+    }
+    case kLockstepAbsolute: {
+      std::fill(address, address + kLockstepLanes, word);
+      length = 3;
+      break;
+    }
+    case kLockstepAbsoluteX: {
+      for (size_t l = 0; l < kLockstepLanes; l++)
+        address[l] = word + group.X[l];
+      length = 3;
+      break;
+    }
+    case kLockstepAbsoluteY: {
+      for (size_t l = 0; l < kLockstepLanes; l++)
+        address[l] = word + group.Y[l];
+      length = 3;
+      break;
+    }
+  }
+
+  // Operands of every lane, masked out lanes may read anything
+  uint8_t value[kLockstepLanes] = {};
+  switch (instruction.operation) {
+    case kLockstepLDA:
+    case kLockstepLDX:
+    case kLockstepLDY:
+    case kLockstepADC:
+    case kLockstepSBC:
+    case kLockstepAND:
+    case kLockstepORA:
+    case kLockstepEOR:
+    case kLockstepBIT:
+    case kLockstepCMP:
+    case kLockstepCPX:
+    case kLockstepCPY:
+    case kLockstepINC:
+    case kLockstepDEC: {
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        if (mask[l])
+          value[l] = this->read(group, l, address[l]);
+      }
+      break;
+    }
+  }
+
+  // Register operations are written without branches on the lane, so they can be vectorized
+  uint8_t* A = group.A;
+  uint8_t* X = group.X;
+  uint8_t* Y = group.Y;
+  uint8_t* P = group.STATUS;
+  switch (instruction.operation) {
+    case kLockstepLDA:
+    case kLockstepAND:
+    case kLockstepORA:
+    case kLockstepEOR:
+    case kLockstepTXA:
+    case kLockstepTYA: {
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        uint8_t result = value[l];
+        if (instruction.operation == kLockstepAND)
+          result = A[l] & value[l];
+        if (instruction.operation == kLockstepORA)
+          result = A[l] | value[l];
+        if (instruction.operation == kLockstepEOR)
+          result = A[l] ^ value[l];
+        if (instruction.operation == kLockstepTXA)
+          result = X[l];
+        if (instruction.operation == kLockstepTYA)
+          result = Y[l];
+        A[l] = mask[l] ? result : A[l];
+        P[l] = mask[l] ? update_sign_zero(P[l], result) : P[l];
+      }
+      break;
+    }
+    case kLockstepLDX:
+    case kLockstepTAX:
+    case kLockstepINX:
+    case kLockstepDEX: {
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        uint8_t result = value[l];
+        if (instruction.operation == kLockstepTAX)
+          result = A[l];
+        if (instruction.operation == kLockstepINX)
+          result = X[l] + 1;
+        if (instruction.operation == kLockstepDEX)
+          result = X[l] - 1;
+        X[l] = mask[l] ? result : X[l];
+        P[l] = mask[l] ? update_sign_zero(P[l], result) : P[l];
+      }
+      break;
+    }
+    case kLockstepLDY:
+    case kLockstepTAY:
+    case kLockstepINY:
+    case kLockstepDEY: {
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        uint8_t result = value[l];
+        if (instruction.operation == kLockstepTAY)
+          result = A[l];
+        if (instruction.operation == kLockstepINY)
+          result = Y[l] + 1;
+        if (instruction.operation == kLockstepDEY)
+          result = Y[l] - 1;
+        Y[l] = mask[l] ? result : Y[l];
+        P[l] = mask[l] ? update_sign_zero(P[l], result) : P[l];
+      }
+      break;
+    }
+    case kLockstepSTA:
+    case kLockstepSTX:
+    case kLockstepSTY: {
+      const uint8_t* source = instruction.operation == kLockstepSTA ? A : instruction.operation == kLockstepSTX ? X : Y;
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        if (mask[l])
+          this->write(group, l, address[l], source[l]);
+      }
+      break;
+    }
+    case kLockstepADC: {
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        uint16_t result = value[l] + A[l] + (P[l] & kMaskCarry);
+        uint8_t status = update_flag(P[l], kMaskZero, !(result & 0xFF));
+
+        // Decimal mode only updates the zero flag, just like the CPU
+        if (!(status & kMaskDecimal)) {
+          status = update_flag(status, kMaskSign, result & 0x80);
+          status = update_flag(status, kMaskOverflow, !((A[l] ^ value[l]) & 0x80) && ((A[l] ^ result) & 0x80));
+          status = update_flag(status, kMaskCarry, result > 0xFF);
+        }
+        P[l] = mask[l] ? status : P[l];
+        A[l] = mask[l] ? result & 0xFF : A[l];
+      }
+      break;
+    }
+    case kLockstepSBC: {
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        uint16_t result = A[l] - value[l] - (P[l] & kMaskCarry);
+        uint8_t status = update_flag(P[l], kMaskSign, result & 0x80);
+        status = update_flag(status, kMaskZero, !(result & 0xFF));
+        status = update_flag(status, kMaskOverflow, ((A[l] ^ result) & 0x80) && ((A[l] ^ value[l]) & 0x80));
+        status = update_flag(status, kMaskCarry, result < 0x100);
+        P[l] = mask[l] ? status : P[l];
+        A[l] = mask[l] ? result & 0xFF : A[l];
+      }
+      break;
+    }
+    case kLockstepBIT: {
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        uint8_t result = A[l] & value[l];
+        uint8_t status = update_sign_zero(P[l], result);
+        status = update_flag(status, kMaskOverflow, result & 0x40);
+        P[l] = mask[l] ? status : P[l];
+      }
+      break;
+    }
+    case kLockstepCMP:
+    case kLockstepCPX:
+    case kLockstepCPY: {
+      const uint8_t* source = instruction.operation == kLockstepCMP ? A : instruction.operation == kLockstepCPX ? X : Y;
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        uint16_t result = source[l] - value[l];
+        uint8_t status = update_flag(P[l], kMaskCarry, result < 0x100);
+        status = update_flag(status, kMaskSign, result & 0x80);
+        status = update_flag(status, kMaskZero, !(result & 0xFF));
+        P[l] = mask[l] ? status : P[l];
+      }
+      break;
+    }
+    case kLockstepINC:
+    case kLockstepDEC: {
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        if (!mask[l])
+          continue;
+        uint8_t result = instruction.operation == kLockstepINC ? value[l] + 1 : value[l] - 1;
+        P[l] = update_sign_zero(P[l], result);
+        this->write(group, l, address[l], result);
+      }
+      break;
+    }
+    case kLockstepCLC:
+    case kLockstepSEC: {
+      for (size_t l = 0; l < kLockstepLanes; l++) {
+        uint8_t status = update_flag(P[l], kMaskCarry, instruction.operation == kLockstepSEC);
+        P[l] = mask[l] ? status : P[l];
+      }
+      break;
+    }
+  }
+
+  // Advance the program counters, branches add their offset without sign extension like the CPU does
+  uint64_t lanes = 0;
+  for (size_t l = 0; l < kLockstepLanes; l++) {
+    uint16_t next = pc + length;
+    if (instruction.operation == kLockstepJMP)
+      next = word;
+    if (instruction.operation == kLockstepBranchSet && (P[l] & instruction.flag))
+      next += operand;
+    if (instruction.operation == kLockstepBranchClear && !(P[l] & instruction.flag))
+      next += operand;
+    group.PC[l] = mask[l] ? next : group.PC[l];
+    group.cycles[l] += mask[l] ? kOpcodeCycles[opcode] : 0;
+    group.instructions[l] += mask[l];
+    lanes += mask[l];
+  }
+
+  this->vector_instructions += lanes;
+  this->vector_steps++;
+  return true;
+}
+
+void LockstepEngine::step_scalar(Group& group, const bool* mask) {
+  CPU& cpu = this->cpu;
+  for (size_t l = 0; l < kLockstepLanes; l++) {
+    if (!mask[l])
+      continue;
+
+    this->ram.memory = group.ram[l];
+    cpu.A = group.A[l];
+    cpu.X = group.X[l];
+    cpu.Y = group.Y[l];
+    cpu.SP = group.SP[l];
+    cpu.STATUS = group.STATUS[l];
+    cpu.PC = group.PC[l];
+    cpu.cycles = group.cycles[l];
+    cpu.instructions = group.instructions[l];
+    cpu.illegal_opcode = false;
+    cpu.int_res = group.flags[l] & kMachinePoolReset;
+
+    // WAI idles until the end of the budget, like it does inside of run_for()
+    cpu.run_end = group.end[l];
+    cpu.step();
+    cpu.run_end = kCycleNever;
+
+    this->scalar_instructions += cpu.instructions - group.instructions[l];
+    group.A[l] = cpu.A;
+    group.X[l] = cpu.X;
+    group.Y[l] = cpu.Y;
+    group.SP[l] = cpu.SP;
+    group.STATUS[l] = cpu.STATUS;
+    group.PC[l] = cpu.PC;
+    group.cycles[l] = cpu.cycles;
+    group.instructions[l] = cpu.instructions;
+    group.flags[l] = (cpu.illegal_opcode ? kMachinePoolHalted : 0) | (cpu.int_res ? kMachinePoolReset : 0);
+  }
+}
+
+}  // namespace M6502
@@ -0,0 +1,79 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "machine.h"
+#include "snapshot.h"
+
+namespace M6502 {
+
+Machine::Machine()
+    : ram(kAddrRAM), io(kAddrIO), rom(std::make_shared<ROMModule<kSizeROM>>(kAddrROM)), cpu(&this->bus) {
+  this->bus.attach_ram(&this->ram);
+  this->bus.attach_io(&this->io);
+  this->bus.attach_rom(this->rom.get());
+  this->io.start_single_threaded(true);
+}
+
+Machine::Machine(Machine& parent)
+    : ram(kAddrRAM, parent.ram), io(kAddrIO), rom(parent.rom), cpu(&this->bus) {
+  this->bus.attach_ram(&this->ram);
+  this->bus.attach_io(&this->io);
+
+  // ROM is read only and doesn't use its bus, so it can be shared by several of them
+  this->bus.attach_rom(this->rom.get());
+  this->io.start_single_threaded(true);
+}
+
+std::unique_ptr<Machine> Machine::fork() {
+  // The constructor is private, so make_unique can't call it
+  std::unique_ptr<Machine> child(new Machine(*this));
+
+  SnapshotWriter writer;
+  this->cpu.snapshot(writer);
+  this->io.snapshot(writer);
+
+  // The CPU goes first, so the IO chip restores its timers relative to the cycle count
+  const std::vector<uint8_t>& data = writer.get_data();
+  SnapshotReader reader(data.data(), data.size());
+  reader.read_header();
+  child->cpu.restore(reader);
+  child->io.restore(reader);
+
+  return child;
+}
+
+uint64_t Machine::run_frame() {
+  uint64_t executed = this->cpu.run_for(kClockRate / 60);
+  this->io.run_frame();
+  return executed;
+}
+
+void Machine::reset() {
+  this->bus.int_res();
+}
+
+}  // namespace M6502
@@ -0,0 +1,119 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sys/mman.h>
+
+#include "machinepool.h"
+
+namespace M6502 {
+
+MachinePool::MachinePool(size_t count, size_t ram_size) {
+  ram_size = std::min(ram_size, kSizeRAM);
+  this->ram_size = (ram_size + kMachinePoolPageSize - 1) / kMachinePoolPageSize * kMachinePoolPageSize;
+  this->arena_size = count * this->ram_size;
+
+  // Anonymous mappings are zeroed lazily, so untouched pages don't take up any memory
+  void* arena = mmap(nullptr, std::max<size_t>(this->arena_size, 1), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (arena == MAP_FAILED)
+    count = 0;
+  else
+    this->arena = static_cast<uint8_t*>(arena);
+
+  this->count = count;
+  this->A.resize(count);
+  this->X.resize(count);
+  this->Y.resize(count);
+  this->SP.resize(count);
+  this->PC.resize(count);
+  this->STATUS.resize(count);
+  this->cycles.resize(count);
+  this->instructions.resize(count);
+  this->flags.resize(count, kMachinePoolReset);
+}
+
+MachinePool::~MachinePool() {
+  if (this->arena != nullptr)
+    munmap(this->arena, std::max<size_t>(this->arena_size, 1));
+}
+
+void MachinePool::reset(size_t index) {
+  this->flags[index] |= kMachinePoolReset;
+}
+
+void MachinePool::run_for(size_t first, size_t last, uint64_t cycles) {
+  Bus bus;
+  PoolMemory ram(kAddrRAM);
+  PoolMemory rom(kAddrROM);
+  ram.size = this->ram_size;
+  rom.memory = this->rom;
+  rom.size = kSizeROM;
+  rom.writable = false;
+  bus.attach_ram(&ram);
+  bus.attach_rom(&rom);
+
+  // Makes WAI idle until the end of the slice, instead of waiting for an interrupt which never comes
+  bus.enable_virtual_time();
+
+  CPU cpu(&bus);
+  for (size_t i = first; i < last; i++) {
+    if (this->flags[i] == kMachinePoolHalted)
+      continue;
+
+    ram.memory = this->get_ram(i);
+    this->load(cpu, i);
+    cpu.run_for(cycles);
+    this->store(cpu, i);
+  }
+}
+
+void MachinePool::load(CPU& cpu, size_t index) {
+  cpu.A = this->A[index];
+  cpu.X = this->X[index];
+  cpu.Y = this->Y[index];
+  cpu.SP = this->SP[index];
+  cpu.PC = this->PC[index];
+  cpu.STATUS = this->STATUS[index];
+  cpu.cycles = this->cycles[index];
+  cpu.instructions = this->instructions[index];
+  cpu.illegal_opcode = this->flags[index] == kMachinePoolHalted;
+  cpu.int_res = this->flags[index] & kMachinePoolReset;
+}
+
+void MachinePool::store(CPU& cpu, size_t index) {
+  this->A[index] = cpu.A;
+  this->X[index] = cpu.X;
+  this->Y[index] = cpu.Y;
+  this->SP[index] = cpu.SP;
+  this->PC[index] = cpu.PC;
+  this->STATUS[index] = cpu.STATUS;
+  this->cycles[index] = cpu.cycles;
+  this->instructions[index] = cpu.instructions;
+  this->flags[index] = (cpu.illegal_opcode ? kMachinePoolHalted : 0) | (cpu.int_res ? kMachinePoolReset : 0);
+}
+
+}  // namespace M6502
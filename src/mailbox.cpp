@@ -0,0 +1,148 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "mailbox.h"
+
+namespace M6502 {
+
+uint8_t MailboxDevice::read(uint16_t address) {
+  std::unique_lock<std::mutex> lk(this->mutex);
+
+  if (address >= kMailboxSemaphores && address < kMailboxSemaphores + kMailboxSemaphoreCount) {
+    uint8_t& semaphore = this->semaphores[address - kMailboxSemaphores];
+    if (semaphore == 0)
+      return 0;
+    semaphore--;
+    return 1;
+  }
+
+  if (address >= kMailboxMessages && address < kMailboxMessages + kMaxCores) {
+    Mailbox& mailbox = this->mailboxes[address - kMailboxMessages];
+    if (mailbox.count == 0)
+      return 0;
+    uint8_t message = mailbox.messages[mailbox.head];
+    mailbox.head = (mailbox.head + 1) % kMailboxDepth;
+    mailbox.count--;
+    return message;
+  }
+
+  return this->peek(address);
+}
+
+void MailboxDevice::write(uint16_t address, uint8_t value) {
+  if (address == kMailboxInterruptMask) {
+    std::unique_lock<std::mutex> lk(this->mutex);
+    this->interrupt_mask = value;
+    return;
+  }
+
+  if (address >= kMailboxSemaphores && address < kMailboxSemaphores + kMailboxSemaphoreCount) {
+    std::unique_lock<std::mutex> lk(this->mutex);
+    uint8_t& semaphore = this->semaphores[address - kMailboxSemaphores];
+    semaphore = std::min(semaphore + value, 0xFF);
+    return;
+  }
+
+  if (address >= kMailboxMessages && address < kMailboxMessages + kMaxCores) {
+    uint8_t core = address - kMailboxMessages;
+    bool interrupt;
+    {
+      std::unique_lock<std::mutex> lk(this->mutex);
+      Mailbox& mailbox = this->mailboxes[core];
+      if (mailbox.count == kMailboxDepth)
+        return;
+      mailbox.messages[(mailbox.head + mailbox.count) % kMailboxDepth] = value;
+      mailbox.count++;
+      interrupt = this->interrupt_mask & (1 << core);
+    }
+
+    // The receiving core might be waiting for the interrupt, so the mutex is released first
+    if (interrupt)
+      this->bus->int_irq(core);
+  }
+}
+
+void MailboxDevice::read_block(uint16_t address, uint8_t* buffer, size_t size) {
+  std::unique_lock<std::mutex> lk(this->mutex);
+  for (size_t i = 0; i < size; i++)
+    buffer[i] = this->peek(address + i);
+}
+
+uint8_t MailboxDevice::peek(uint16_t address) {
+  switch (address) {
+    case kMailboxCoreID: return Bus::current_core;
+    case kMailboxCoreCount: return this->bus->get_core_count();
+    case kMailboxStatus: {
+      uint8_t status = 0;
+      for (size_t i = 0; i < kMaxCores; i++) {
+        if (this->mailboxes[i].count > 0)
+          status |= 1 << i;
+      }
+      return status;
+    }
+    case kMailboxInterruptMask: return this->interrupt_mask;
+  }
+
+  if (address >= kMailboxSemaphores && address < kMailboxSemaphores + kMailboxSemaphoreCount)
+    return this->semaphores[address - kMailboxSemaphores];
+
+  if (address >= kMailboxMessages && address < kMailboxMessages + kMaxCores) {
+    const Mailbox& mailbox = this->mailboxes[address - kMailboxMessages];
+    return mailbox.count > 0 ? mailbox.messages[mailbox.head] : 0;
+  }
+
+  return 0;
+}
+
+void MailboxDevice::snapshot(SnapshotWriter& writer) {
+  std::unique_lock<std::mutex> lk(this->mutex);
+  writer.write_byte(this->interrupt_mask);
+  for (uint8_t semaphore : this->semaphores)
+    writer.write_byte(semaphore);
+  for (const Mailbox& mailbox : this->mailboxes) {
+    writer.write_byte(mailbox.count);
+    for (size_t i = 0; i < mailbox.count; i++)
+      writer.write_byte(mailbox.messages[(mailbox.head + i) % kMailboxDepth]);
+  }
+}
+
+void MailboxDevice::restore(SnapshotReader& reader) {
+  std::unique_lock<std::mutex> lk(this->mutex);
+  this->interrupt_mask = reader.read_byte();
+  for (uint8_t& semaphore : this->semaphores)
+    semaphore = reader.read_byte();
+  for (Mailbox& mailbox : this->mailboxes) {
+    mailbox.head = 0;
+    mailbox.count = std::min<size_t>(reader.read_byte(), kMailboxDepth);
+    for (size_t i = 0; i < mailbox.count; i++)
+      mailbox.messages[i] = reader.read_byte();
+  }
+}
+
+}  // namespace M6502
@@ -25,22 +25,51 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <thread>
-#include <cstring>
+#include <vector>
 
+#include "audiosynth.h"
+#include "batch.h"
 #include "bus.h"
 #include "cpu.h"
+#include "inputlog.h"
 #include "iochip.h"
 #include "rammodule.h"
 #include "rommodule.h"
+#include "snapshot.h"
 
 using namespace M6502;
 
-int main() {
+int main(int argc, char** argv) {
   using namespace std::chrono_literals;
 
+  // Run the CPU and all devices on a single thread
+  bool single_threaded = argc > 1 && std::strcmp(argv[1], "--single-threaded") == 0;
+
+  // Run for a given amount of emulated seconds without a window and save the audio output
+  //
+  // Usage: --headless <seconds> <wav file>
+  bool headless = argc > 3 && std::strcmp(argv[1], "--headless") == 0;
+
+  // Run single threaded and record all input into a log, or replay such a log as fast as possible
+  // without a window
+  //
+  // Usage: --record <log file>
+  //        --replay <log file>
+  bool record = argc > 2 && std::strcmp(argv[1], "--record") == 0;
+  bool replay = argc > 2 && std::strcmp(argv[1], "--replay") == 0;
+
+  // Run the program on many machines in parallel for a given amount of instructions each and
+  // report the throughput
+  //
+  // Usage: --batch <machines> <instructions>
+  bool batch = argc > 3 && std::strcmp(argv[1], "--batch") == 0;
+
   // Create the machine parts
   RAMModule<kSizeRAM> ram(kAddrRAM);
   IOChip io(kAddrIO);
@@ -110,11 +139,102 @@ int main() {
   CPU cpu(&bus);
   bus.attach_cpu(&cpu);
 
+  if (batch) {
+    BatchJob job;
+    job.image.assign(rom.get_buffer(), rom.get_buffer() + kSizeROM);
+    job.instruction_budget = std::strtoull(argv[3], nullptr, 10);
+    std::vector<BatchJob> jobs(std::strtoull(argv[2], nullptr, 10), job);
+
+    BatchRunner runner;
+    std::vector<BatchResult> results = runner.run(jobs);
+
+    size_t halted = std::count_if(results.begin(), results.end(), [](BatchResult& r) { return r.illegal_opcode; });
+    std::cout << results.size() << " machines, " << halted << " halted, " << runner.get_instructions()
+              << " instructions in " << runner.get_seconds() << "s on " << runner.get_thread_count()
+              << " threads (" << runner.get_mips() << " MIPS)" << std::endl;
+    return 0;
+  }
+
+  if (headless) {
+    io.start_single_threaded(true);
+    io.start_offline_audio();
+
+    // Frames are emulated as well, so the VBLANK interrupt keeps working
+    uint64_t remaining = std::strtoull(argv[2], nullptr, 10) * kClockRate;
+    std::vector<sf::Int16> samples;
+    while (remaining > 0 && !cpu.shutdown && !cpu.illegal_opcode) {
+      uint64_t executed = cpu.run_for(std::min<uint64_t>(remaining, kClockRate / 60));
+      remaining -= std::min(executed, remaining);
+      io.run_frame();
+      io.render_offline_audio(samples);
+    }
+
+    io.stop();
+    cpu.dump_state(std::cout);
+    if (!write_wav(argv[3], samples, kIOAudioSampleRate)) {
+      std::cerr << "could not write " << argv[3] << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (replay) {
+    InputLog log;
+    std::vector<uint8_t> data;
+    io.start_single_threaded(true);
+    if (!load_snapshot(argv[2], data) || !log.deserialize(data) || !bus.start_replay(&log)) {
+      std::cerr << "could not replay " << argv[2] << std::endl;
+      return 1;
+    }
+
+    // The frames have to be sliced exactly like while recording
+    while (cpu.cycles < log.end_cycle && !cpu.shutdown && !cpu.illegal_opcode) {
+      cpu.run_for(std::min<uint64_t>(log.end_cycle - cpu.cycles, kClockRate / 60));
+      io.run_frame();
+    }
+
+    io.stop();
+    cpu.dump_state(std::cout);
+    return 0;
+  }
+
+  if (single_threaded || record) {
+    InputLog log;
+    io.start_single_threaded(false);
+    if (record)
+      bus.start_recording(&log);
+
+    // Execute one frame worth of cycles, then let the IO chip present the frame
+    auto next_frame = std::chrono::steady_clock::now();
+    while (io.is_running() && !cpu.shutdown && !cpu.illegal_opcode) {
+      cpu.run_for(kClockRate / 60);
+      io.run_frame();
+
+      next_frame += 16ms;
+      std::this_thread::sleep_until(next_frame);
+    }
+
+    io.stop();
+    cpu.dump_state(std::cout);
+
+    if (record) {
+      bus.stop_recording();
+      if (!save_snapshot(argv[2], log.serialize())) {
+        std::cerr << "could not write " << argv[2] << std::endl;
+        return 1;
+      }
+    }
+    return 0;
+  }
+
   std::thread cpu_thread([&]() {
     cpu.dump_state(std::cout);
     cpu.start();
     std::cout << "cpu halted" << std::endl;
     cpu.dump_state(std::cout);
+
+    // Lets the IO chip return if the guest never opened a window
+    io.cpu_halted();
   });
 
   io.start();
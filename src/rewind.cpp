@@ -0,0 +1,71 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "rewind.h"
+#include "bus.h"
+
+namespace M6502 {
+
+RewindBuffer::RewindBuffer(Bus* bus, size_t capacity) : bus(bus), capacity(capacity) {
+}
+
+void RewindBuffer::capture() {
+  std::vector<uint8_t> capture = this->bus->snapshot_delta();
+  capture.shrink_to_fit();
+  this->used += capture.size();
+  this->captures.push_back(std::move(capture));
+
+  // The latest capture is always kept, even if it exceeds the capacity on its own
+  while (this->used > this->capacity && this->captures.size() > 1) {
+    this->used -= this->captures.front().size();
+    this->captures.pop_front();
+  }
+}
+
+bool RewindBuffer::rewind(size_t n) {
+  if (n == 0 || n > this->captures.size())
+    return false;
+
+  // Revert the changes made since the latest capture
+  this->bus->restore_delta(this->bus->snapshot_delta(), true, false);
+
+  // Every capture holds the pages as they were at the one before it
+  for (size_t i = 1; i < n; i++) {
+    this->bus->restore_delta(this->captures.back(), true, false);
+    this->used -= this->captures.back().size();
+    this->captures.pop_back();
+  }
+
+  return this->bus->restore_delta(this->captures.back(), false, true);
+}
+
+void RewindBuffer::clear() {
+  this->captures.clear();
+  this->used = 0;
+}
+
+}  // namespace M6502
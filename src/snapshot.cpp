@@ -0,0 +1,253 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "snapshot.h"
+
+namespace M6502 {
+
+SnapshotWriter::SnapshotWriter() {
+  this->data.insert(this->data.end(), kSnapshotMagic, kSnapshotMagic + sizeof(kSnapshotMagic));
+  this->write_word(kSnapshotVersion);
+}
+
+void SnapshotWriter::write_byte(uint8_t value) {
+  this->data.push_back(value);
+}
+
+void SnapshotWriter::write_word(uint16_t value) {
+  this->write_byte(value & 0xFF);
+  this->write_byte(value >> 8);
+}
+
+void SnapshotWriter::write_long(uint32_t value) {
+  this->write_word(value & 0xFFFF);
+  this->write_word(value >> 16);
+}
+
+void SnapshotWriter::write_quad(uint64_t value) {
+  this->write_long(value & 0xFFFFFFFF);
+  this->write_long(value >> 32);
+}
+
+void SnapshotWriter::write_block(const uint8_t* buffer, size_t size) {
+  size_t i = 0;
+  while (i < size) {
+    size_t run = 1;
+    while (i + run < size && run < kSnapshotMaxRun && buffer[i + run] == buffer[i])
+      run++;
+
+    if (run >= 2) {
+      this->write_byte(kSnapshotRun | (run - 2));
+      this->write_byte(buffer[i]);
+      i += run;
+      continue;
+    }
+
+    // Collect literals up to the next run of at least 3 bytes, shorter runs
+    // don't save any space
+    size_t start = i;
+    while (i < size && i - start < kSnapshotMaxLiteral) {
+      if (i + 2 < size && buffer[i] == buffer[i + 1] && buffer[i] == buffer[i + 2])
+        break;
+      i++;
+    }
+    this->write_byte(i - start - 1);
+    this->data.insert(this->data.end(), buffer + start, buffer + i);
+  }
+}
+
+void SnapshotWriter::write_pages(const uint8_t* buffer, uint8_t* shadow, bool* dirty, size_t size) {
+  // The count is patched in once the changed pages are known
+  size_t count_position = this->data.size();
+  uint16_t count = 0;
+  this->write_word(0);
+
+  size_t page_count = (size + kSnapshotPageSize - 1) / kSnapshotPageSize;
+  for (size_t page = 0; page < page_count; page++) {
+    if (!dirty[page])
+      continue;
+    dirty[page] = false;
+
+    size_t offset = page * kSnapshotPageSize;
+    size_t length = std::min(kSnapshotPageSize, size - offset);
+    if (std::memcmp(buffer + offset, shadow + offset, length) == 0)
+      continue;
+
+    this->write_word(page);
+    this->write_block(shadow + offset, length);
+    std::memcpy(shadow + offset, buffer + offset, length);
+    count++;
+  }
+
+  this->data[count_position] = count & 0xFF;
+  this->data[count_position + 1] = count >> 8;
+}
+
+void SnapshotWriter::begin_section(uint8_t id) {
+  this->write_byte(id);
+  this->section_start = this->data.size();
+  this->write_long(0);
+}
+
+void SnapshotWriter::end_section() {
+  // Patch the size of the payload into the section header
+  uint32_t size = this->data.size() - this->section_start - 4;
+  for (int i = 0; i < 4; i++)
+    this->data[this->section_start + i] = (size >> (i * 8)) & 0xFF;
+}
+
+SnapshotReader::SnapshotReader(const uint8_t* data, size_t size) : data(data), size(size) {
+}
+
+bool SnapshotReader::read_header() {
+  if (this->size < sizeof(kSnapshotMagic) + 2 ||
+      std::memcmp(this->data, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) {
+    this->error = true;
+    return false;
+  }
+  this->position = sizeof(kSnapshotMagic);
+
+  if (this->read_word() != kSnapshotVersion) {
+    this->error = true;
+    return false;
+  }
+  return true;
+}
+
+uint8_t SnapshotReader::read_byte() {
+  if (this->error || this->position >= this->size) {
+    this->error = true;
+    return 0;
+  }
+  return this->data[this->position++];
+}
+
+uint16_t SnapshotReader::read_word() {
+  uint16_t value = this->read_byte();
+  return value | (this->read_byte() << 8);
+}
+
+uint32_t SnapshotReader::read_long() {
+  uint32_t value = this->read_word();
+  return value | (static_cast<uint32_t>(this->read_word()) << 16);
+}
+
+uint64_t SnapshotReader::read_quad() {
+  uint64_t value = this->read_long();
+  return value | (static_cast<uint64_t>(this->read_long()) << 32);
+}
+
+void SnapshotReader::read_block(uint8_t* buffer, size_t size) {
+  size_t offset = 0;
+  while (offset < size && !this->error) {
+    uint8_t control = this->read_byte();
+    size_t length = control & kSnapshotRun ? (control & ~kSnapshotRun) + 2 : control + 1;
+    if (length > size - offset) {
+      this->error = true;
+      return;
+    }
+
+    if (control & kSnapshotRun) {
+      std::memset(buffer + offset, this->read_byte(), length);
+    } else {
+      if (length > this->size - this->position) {
+        this->error = true;
+        return;
+      }
+      std::memcpy(buffer + offset, this->data + this->position, length);
+      this->position += length;
+    }
+    offset += length;
+  }
+}
+
+void SnapshotReader::read_pages(uint8_t* buffer, uint8_t* shadow, size_t size, bool apply) {
+  uint16_t count = this->read_word();
+  for (uint16_t i = 0; i < count && !this->error; i++) {
+    size_t offset = this->read_word() * kSnapshotPageSize;
+    if (offset >= size) {
+      this->error = true;
+      return;
+    }
+
+    size_t length = std::min(kSnapshotPageSize, size - offset);
+    if (apply) {
+      this->read_block(buffer + offset, length);
+      std::memcpy(shadow + offset, buffer + offset, length);
+    } else {
+      uint8_t discard[kSnapshotPageSize];
+      this->read_block(discard, length);
+    }
+  }
+}
+
+bool SnapshotReader::begin_section(uint8_t id) {
+  uint8_t section_id = this->read_byte();
+  uint32_t section_size = this->read_long();
+  if (this->error || section_id != id || section_size > this->size - this->position) {
+    this->error = true;
+    return false;
+  }
+  this->section_end = this->position + section_size;
+  return true;
+}
+
+bool SnapshotReader::end_section() {
+  if (this->position != this->section_end)
+    this->error = true;
+  return !this->error;
+}
+
+void SnapshotReader::skip_section() {
+  if (this->position > this->section_end)
+    this->error = true;
+  if (!this->error)
+    this->position = this->section_end;
+}
+
+bool save_snapshot(const std::string& path, const std::vector<uint8_t>& data) {
+  std::ofstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  file.write(reinterpret_cast<const char*>(data.data()), data.size());
+  return static_cast<bool>(file);
+}
+
+bool load_snapshot(const std::string& path, std::vector<uint8_t>& data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+}  // namespace M6502
@@ -0,0 +1,134 @@
+/*
+ * This file is part of the MOS 6502 Emulator
+ * (https://github.com/KCreate/mos6502)
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 - 2018 Leonard Schütz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "threadpool.h"
+
+namespace M6502 {
+
+// The pool and queue index of the worker running on the current thread
+static thread_local ThreadPool* current_pool = nullptr;
+static thread_local size_t current_queue = 0;
+
+ThreadPool::ThreadPool(size_t thread_count) {
+  // hardware_concurrency() returns 0 if it can't tell
+  thread_count = std::max<size_t>(thread_count, 1);
+  for (size_t i = 0; i < thread_count; i++)
+    this->queues.push_back(std::make_unique<WorkerQueue>());
+  for (size_t i = 0; i < thread_count; i++)
+    this->workers.emplace_back(&ThreadPool::thread_worker, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lk(this->idle_mutex);
+    this->shutdown = true;
+  }
+  this->condition_jobs.notify_all();
+  for (std::thread& worker : this->workers)
+    worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> job) {
+  // The job is counted before any worker can take it, otherwise it could finish and let wait() return
+  // while the job which submitted it is still submitting more
+  {
+    std::unique_lock<std::mutex> lk(this->idle_mutex);
+    this->pending++;
+  }
+
+  size_t index = current_pool == this ? current_queue : this->next_queue++ % this->queues.size();
+  {
+    std::unique_lock<std::mutex> lk(this->queues[index]->mutex);
+    this->queues[index]->jobs.push_back(std::move(job));
+  }
+
+  // Sleeping workers check the queued count while holding the idle mutex, so they can't miss the job
+  {
+    std::unique_lock<std::mutex> lk(this->idle_mutex);
+    this->queued++;
+  }
+  this->condition_jobs.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lk(this->idle_mutex);
+  this->condition_idle.wait(lk, [&]() { return this->pending == 0; });
+}
+
+bool ThreadPool::take_job(size_t index, std::function<void()>& job) {
+  {
+    WorkerQueue& own = *this->queues[index];
+    std::unique_lock<std::mutex> lk(own.mutex);
+    if (!own.jobs.empty()) {
+      job = std::move(own.jobs.back());
+      own.jobs.pop_back();
+      this->queued--;
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i < this->queues.size(); i++) {
+    WorkerQueue& victim = *this->queues[(index + i) % this->queues.size()];
+    std::unique_lock<std::mutex> lk(victim.mutex);
+    if (!victim.jobs.empty()) {
+      job = std::move(victim.jobs.front());
+      victim.jobs.pop_front();
+      this->queued--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::thread_worker(size_t index) {
+  current_pool = this;
+  current_queue = index;
+
+  for (;;) {
+    std::function<void()> job;
+    if (!this->take_job(index, job)) {
+      std::unique_lock<std::mutex> lk(this->idle_mutex);
+      this->condition_jobs.wait(lk, [&]() { return this->queued > 0 || this->shutdown; });
+
+      // Remaining jobs are finished before shutting down
+      if (this->queued == 0)
+        return;
+      continue;
+    }
+
+    job();
+
+    std::unique_lock<std::mutex> lk(this->idle_mutex);
+    if (--this->pending == 0)
+      this->condition_idle.notify_all();
+  }
+}
+
+}  // namespace M6502